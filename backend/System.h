@@ -0,0 +1,407 @@
+#pragma once
+
+#include "backend/Common.h"
+
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#include <exception>
+#endif
+
+namespace pimsim {
+
+class MemoryChip;
+class GlobalConnection;
+class MemoryCharacteristics;
+
+/*
+ * The whole PIM system: chips behind one host, the network between them,
+ * and the kernels mapped onto it. Requests enter through sendRequest (or a
+ * compiled Program) and are decomposed into per-block leaf requests that
+ * are handed to the chips.
+ */
+class System {
+public:
+    /* Operand formats of the arithmetic kernels */
+    enum class Precision { Int4, Int8, Int16, Int32, BF16, FP32 };
+    /* Payload encodings for cross-chip transfers */
+    enum class Compression { None, ZeroRun, BitPlane, BaseDelta };
+
+    /* One configuration of a design-space sweep */
+    struct DesignPoint {
+        int nchips, ntiles, nblocks, nrows, ncols;
+        std::string netscheme;
+        std::string rstfile;
+    };
+    struct DesignResult {
+        DesignPoint point;
+        bool ok;        /* false if the trace does not fit the point */
+        TimeT cycles;
+        double energy;
+        uint64_t net_reqs, net_bytes, net_clks;
+        bool pareto;
+        double error;
+    };
+    /* Analytic estimate of a trace, see calibrateEstimator */
+    struct Estimate {
+        double cycles;
+        double energy;
+        double cycles_error, energy_error;
+    };
+    struct ScanResult {
+        uint64_t records;
+        uint64_t matches;
+        TimeT cycles;
+        double records_per_sec;
+    };
+    /* Decoded address of one addr_list entry */
+    struct Location {
+        int chip, tile, block, row, col;
+    };
+    /* A validated trace with every address decoded up front; the
+     * locations of reqs[k] start at locs[first[k]] and stay valid while
+     * no migration has happened since compilation */
+    struct Program {
+        std::vector<Request> reqs;
+        std::vector<Location> locs;
+        std::vector<size_t> first;
+        int tenant;             // -1 when untagged
+        uint64_t migrations;
+    };
+    /* A workload sharing the system with others */
+    struct Tenant {
+        std::string name;
+        int first_chip, n_chips;
+        int first_block, n_blocks;
+        double weight;
+        bool priority;
+        uint64_t reqs, served, net_clks;
+        TimeT first_issue, last_done;
+        std::vector<TimeT> latency;
+    };
+
+#if defined(__cpp_impl_coroutine)
+    /* A kernel written as a coroutine, see spawn/run */
+    struct Kernel {
+        struct promise_type {
+            Kernel get_return_object() 
+            { 
+                return Kernel(std::coroutine_handle<promise_type>::from_promise(*this)); 
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        explicit Kernel(std::coroutine_handle<promise_type> h) : handle(h) {}
+        Kernel(Kernel&& k) : handle(k.handle) { k.handle = nullptr; }
+        ~Kernel() { if (handle) handle.destroy(); }
+        std::coroutine_handle<promise_type> handle;
+    };
+    struct RequestAwaiter {
+        System* sys;
+        Request req;
+        bool has_req;
+        int tenant = -1;
+        TimeT issued = 0;
+        bool rejected = false;  /* submitted for an unknown tenant */
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h);
+        bool await_resume();
+    };
+#endif
+
+    System(Config* config);
+    System(Config* config, const DesignPoint& point);
+    ~System();
+
+    void addChip(MemoryCharacteristics* values, int n_tiles, int n_blocks, int n_rows, int n_cols, int clock_rate);
+    AddrT getAddress(int chip, int tile, int block, int row, int col);
+    void getLocation(AddrT addr, int &chip_idx, int &tile_idx, int &block_idx, int &row_idx, int &col_idx);
+    void getLocation(AddrT addr, int &chip_idx, int &tile_idx, int &block_idx);
+
+    int sendRequest(Request& req);
+    int prefetch(Request& req);
+    void completeRequests();
+    void sync(const std::vector<int>& chips);
+    int transpose(AddrT src_addr, AddrT dst_addr, int n_rows, int n_cols);
+    int system_sendRow_receiveRow(Request& req, const Location* locs = NULL);
+    int system_sendRow_receiveCol(Request& req, const Location* locs = NULL);
+    int system_sendCol_receiveRow(Request& req, const Location* locs = NULL);
+    int system_sendCol_receiveCol(Request& req, const Location* locs = NULL);
+    bool compile(const std::vector<Request>& trace, Program& prog, int tenant = -1);
+    int runProgram(Program& prog);
+    void finish();
+
+    /* Optional models, all off by default */
+    void setCtrlQueues(bool enable, int depth = 8);
+    void setPrefetch(bool enable);
+    void setPowerCap(double chip_cap, double system_cap, int window);
+    void setPrecision(Precision p);
+    void setFunctional(bool enable);
+    void setMigration(bool enable, double threshold = 2.0, uint64_t interval = 4096);
+    void setCompression(Compression scheme, int bits_per_cycle = 64);
+    void setCompressionRatio(AddrT first, AddrT last, double ratio);
+    bool setLiveStats(const std::string& name, uint64_t target = 0, uint64_t interval = 1024);
+    void closeLiveStats();
+    static int watchStats(const std::string& name, int period_ms = 1000, FILE* out = stdout);
+
+    /* Values in functional mode */
+    void writeValue(AddrT addr, uint64_t value, int width, bool along_row);
+    uint64_t readValue(AddrT addr, int width, bool along_row);
+
+    /* Tenants; controller QoS needs hierarchical controllers, see addTenant() */
+    int addTenant(const std::string& name, int first_chip, int n_chips,
+                  int first_block, int n_blocks, double weight = 1.0, bool priority = false);
+    AddrT tenantAddress(int tenant, int chip, int block, int row, int col);
+    int sendRequest(int tenant, Request& req);
+
+    /* Design-space exploration and the analytic estimator */
+    static std::vector<DesignPoint> parseSweep(Config* config, const std::string& spec);
+    static std::vector<DesignResult> exploreDesignSpace(Config* config, const std::vector<DesignPoint>& points,
+                                                        const std::vector<Request>& trace, int n_threads, FILE* out,
+                                                        bool analytic = false);
+    void calibrateEstimator(const std::vector<Request>& validation);
+    Estimate estimate(const std::vector<Request>& trace);
+
+#if defined(__cpp_impl_coroutine)
+    RequestAwaiter submit(const Request& req);
+    RequestAwaiter submit(int tenant, const Request& req);
+    RequestAwaiter flush();
+    void spawn(Kernel kernel);
+    void run();
+#endif
+
+    /* Kernels */
+    void example_1();
+    void example_2();
+    void example_3();
+    void matrix_mul_area_optimized(int A_row, int A_col, int B_row, int B_col, Precision p = Precision::Int32);
+    void matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_col, Precision p = Precision::Int32);
+    void matrix_mul_balanced(int A_row, int A_col, int B_row, int B_col, Precision p = Precision::Int32);
+    void spmv_csr(int n_rows, int n_cols, const std::vector<int>& row_ptr, const std::vector<int>& col_idx,
+                  const std::vector<uint64_t>& values, int n_vecs = 1, Precision p = Precision::Int32);
+    void spmv_coo(int n_rows, int n_cols, const std::vector<int>& rows, const std::vector<int>& cols,
+                  const std::vector<uint64_t>& values, int n_vecs = 1, Precision p = Precision::Int32);
+    void conv2d(int N, int C, int H, int W, int K, int R, int S, int stride, Precision p = Precision::Int32);
+    ScanResult scan(int first_block, uint64_t n_records, int key_bits, uint64_t key, bool along_rows,
+                    int n_chips = 0);
+    void scan_benchmark();
+    TimeT sort(int first_block, uint64_t n_keys, int key_bits, bool descending = false);
+
+    uint64_t tot_reqs = 0;
+
+private:
+    struct CtrlEntry {
+        Request req;
+        int chip, tile, block, row;
+        uint64_t seq;
+        int tenant;
+    };
+    struct CtrlQueue {
+        std::deque<CtrlEntry> entries;
+        int open_row = -1;
+    };
+    struct LeafCost {
+        double first, first_bit;
+        double extra, extra_bit;
+        double energy, energy_bit;
+        double share;
+    };
+    struct CompressRegion {
+        AddrT first, last;
+        double ratio;
+    };
+    struct LiveStats;
+
+    void init();
+    MemoryChip* newChip(int chip_idx);
+    MemoryChip* getChip(int chip_idx);
+    TimeT chipTime(int chip_idx);
+    double chipEnergy(int chip_idx);
+    int advanceChip(int chip_idx, TimeT time);
+    void reportChips();
+    void syncSet(const std::vector<uint64_t>& set);
+    TimeT systemTime();
+    void locate(const Request& req, const Location* locs, int i,
+                int& chip_idx, int& tile_idx, int& block_idx, int& row_idx, int& col_idx);
+
+    int dispatchRequest(Request& req, const Location* locs = NULL);
+    int sendMoReq(Request& req, const Location* locs = NULL);
+    int sendNetReq(Request& req);
+    int sendTransfer(AddrT src_addr, AddrT dst_addr, int size, bool src_row,
+                     const std::vector<uint8_t>* data = NULL);
+    int sendRowMv(Request& req, const Location* locs = NULL);
+    int sendColMv(Request& req, const Location* locs = NULL);
+    int sendRowPIM(Request& req, const Location* locs = NULL);
+    int sendColPIM(Request& req, const Location* locs = NULL);
+    int sendRowBuffer(Request& req, const Location* locs = NULL);
+    int sendColBuffer(Request& req, const Location* locs = NULL);
+    int sendPimReq(Request& req, const Location* locs = NULL);
+
+    /* Controller queues */
+    int ctrlQueueIndex(int chip_idx, int tile_idx, int block_idx);
+    int issueReq(Request& req, int chip_idx, int tile_idx, int block_idx, int row_idx);
+    int scheduleCtrl(int chip_idx);
+    int drainCtrl(int chip_idx);
+    void reportController();
+
+    /* Power manager */
+    void rollPowerWindow(int chip_idx);
+    int throttlePower(int chip_idx);
+    void reportPower();
+
+    /* Network */
+    bool buildNetTable();
+    int netLatency(int chip1, int chip2, int size);
+    int netSerialize(int chip1, int chip2, int size);
+    int arbitrateNet(int chip1, int chip2, TimeT now, int serialize);
+    void reportTopology();
+    void reportCompression();
+
+    /* Tenants */
+    bool translateRequest(int tenant, Request& req);
+    void tenantDone(int tenant, TimeT issued);
+    void reportTenants();
+
+    /* Migration */
+    double loadSpread(const std::vector<uint64_t>& load, int group, int& hot, int& cold);
+    void remapBlock(int& chip_idx, int& tile_idx, int& block_idx);
+    void balanceBlocks();
+    void reportMigration();
+
+    /* Estimator */
+    System& probeSystem();
+    double probeCost(Request::Type type, int size);
+    void calibrateLeaf(Request::Type type);
+    void estimateLeaf(Request& req, int chip_idx, int tile_idx, int block_idx);
+    int estimateNet(int chip1, int chip2, int net_overhead);
+
+    /* Live statistics */
+    void countLiveStats(Request::Type type);
+    void publishStats(bool finished = false);
+
+    /* Kernel helpers */
+    void precisionOps(Request::Type type, int size, std::vector<std::pair<Request::Type, int>>& ops);
+    Request& batchAdd(int chip, int block, Request::Type type);
+    void batchFlush();
+    AddrT vectorElem(AddrT base, uint64_t idx, int bits);
+    void spmvStorage(int n_rows, int n_cols, const std::vector<int>& row_ptr, const std::vector<int>& col_idx,
+                     const std::vector<uint64_t>* values, int n_vecs, Precision p);
+    bool spmvRun(int n_rows, int n_cols, const std::vector<int>& row_ptr, const std::vector<int>& col_idx,
+                 int n_vecs, Precision p, const std::function<AddrT(int)>& a_at,
+                 const std::function<AddrT(int, int)>& x_at, const std::function<AddrT(int, int)>& y_at);
+
+    /* Functional mode */
+    uint64_t* funcPlane(int chip, int tile, int block, int col);
+    void funcRead(AddrT addr, bool along_row, int size, std::vector<uint8_t>& bits);
+    void funcWrite(AddrT addr, bool along_row, const std::vector<uint8_t>& bits);
+    void funcMove(AddrT src, bool src_row, AddrT dst, bool dst_row, int size);
+    void funcRowOp(Request& req);
+    void funcColOp(Request& req);
+    void funcExec(Request& req);
+
+    Config* _config;
+    int _nchips, _ntiles, _nblocks, _nrows, _ncols, _clock_rate;
+    bool _blockctrl, _tilectrl, _chipctrl, _force_sync;
+    int _blocksize;
+    std::string _netscheme, _rstname;
+    FILE* rstFile;
+    MemoryCharacteristics* _values;
+    GlobalConnection* _conn;
+
+    /* Chips are built lazily; clocks and chip sets are kept per chip */
+    std::vector<MemoryChip*> _chips;
+    std::vector<TimeT> _chip_clock;
+    std::vector<double> _idle_energy;
+    std::vector<uint64_t> _all_chips, _busy_chips;
+    std::vector<TimeT> _sync_clocks;
+
+    /* Controller queues */
+    bool _hierctrl;
+    int _ctrl_queue_depth;
+    uint64_t _ctrl_seq, _ctrl_issued, _ctrl_row_hits, _ctrl_ahead, _ctrl_stalls;
+    std::unordered_map<int, CtrlQueue> _ctrl_queues;
+    std::vector<std::vector<CtrlQueue*>> _ctrl_active;
+    std::vector<int> _ctrl_pending;
+    std::vector<std::deque<uint64_t>> _ctrl_buffer_seqs;
+
+    /* Power manager */
+    double _power_chip_cap, _power_sys_cap;
+    int _power_window;
+    std::vector<TimeT> _power_win_start;
+    std::vector<double> _power_win_energy;
+    std::vector<double> _power_peak;
+    std::vector<uint64_t> _power_throttle;
+
+    /* Network */
+    uint64_t _net_reqs, _net_bytes, _net_clks;
+    std::vector<uint16_t> _net_hops;
+    std::vector<uint32_t> _net_base, _net_bw;
+    std::string _net_desc;
+    bool _prefetch;
+    uint64_t _prefetch_reqs;
+
+    /* Transfer compression */
+    Compression _compress;
+    int _compress_rate;
+    std::vector<CompressRegion> _compress_regions;
+    uint64_t _compress_raw, _compress_wire, _compress_xfers, _compress_used,
+             _compress_enc, _compress_dec;
+
+    /* Kernels */
+    Precision _precision;
+    std::map<std::pair<int, int>, Request> _batch;
+    std::map<std::tuple<int, int, int>, double> _probe_costs;
+    System* _probe;
+    uint64_t _kernel_rounds, _kernel_reqs;
+#if defined(__cpp_impl_coroutine)
+    std::vector<std::coroutine_handle<>> _kernels, _kernels_waiting;
+    std::deque<std::coroutine_handle<>> _kernels_ready;
+#endif
+
+    /* Functional mode */
+    bool _functional;
+    int _func_words;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> _func_blocks;
+    std::vector<uint8_t> _func_buffer;
+
+    /* Tenants */
+    std::vector<Tenant> _tenants;
+    int _cur_tenant;
+    std::vector<TimeT> _port_busy;
+    std::vector<double> _port_usage;
+
+    /* Per-block utilization and migration */
+    std::vector<std::vector<uint64_t>> _block_ops, _block_window;
+    std::vector<int> _block_map;
+    uint64_t _window_ops, _migrate_interval, _migrations, _migrate_clks;
+    bool _migrate, _migrating;
+    double _migrate_threshold, _spread_before, _spread_last;
+
+    /* Estimator */
+    bool _estimating;
+    std::map<int, LeafCost> _leaf_costs;
+    std::unordered_map<int, double> _est_block;
+    std::vector<double> _est_chip, _est_floor, _est_serial;
+    double _est_energy, _est_cycles_error, _est_energy_error;
+
+    /* Live statistics */
+    LiveStats* _live;
+    size_t _live_size;
+    std::string _live_name;
+    uint64_t _live_interval, _live_last, _live_target, _live_goal;
+    std::vector<uint64_t> _live_type_reqs;
+    std::vector<int> _live_slot;
+    uint64_t _host_stalls;
+};
+
+}
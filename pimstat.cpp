@@ -0,0 +1,29 @@
+#include "backend/System.h"
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace pimsim;
+
+/*
+ * Follows a running simulation through the live statistics it exports with
+ * System::setLiveStats():
+ *
+ *     pimstat <segment> [period in ms]
+ *
+ * One line per period with requests, host request rate, simulated time of
+ * the slowest and fastest chip, stall cycles, network traffic, the most
+ * frequent request types and, when the run has a target, the ETA.
+ */
+int
+main(int argc, char** argv)
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <segment> [period in ms]\n";
+        return 1;
+    }
+    int period = argc > 2 ? atoi(argv[2]) : 1000;
+    if (period <= 0)
+        period = 1000;
+    return System::watchStats(argv[1], period);
+}
@@ -0,0 +1,794 @@
+#include "backend/System.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace pimsim;
+
+/*
+ * Regression checks. Every check builds the small systems it needs, runs a
+ * workload on them and looks at the outcome: the numbers in the report
+ * for the timing models, the values read back from the blocks for the
+ * functional mode and the kernels, which are compared with a host
+ * reference.
+ *
+ *     regress [name]...
+ *
+ * Runs the named checks, all of them without arguments. Prints one line
+ * per check and returns non-zero if any of them fails.
+ */
+namespace {
+
+const int n_chips = 2, n_tiles = 1, n_blocks = 8, n_rows = 256, n_cols = 256;
+const char* rst_name = "regress.rst";
+
+System::DesignPoint
+point(int chips = n_chips, const std::string& net = "ideal", const char* rst = rst_name)
+{
+    return {chips, n_tiles, n_blocks, n_rows, n_cols, net, rst};
+}
+
+/* Runs fn on a fresh system and returns the report it leaves behind */
+std::string
+report(Config& config, const System::DesignPoint& p, const std::function<void(System&)>& fn)
+{
+    {
+        System sys(&config, p);
+        fn(sys);
+        sys.finish();
+    }
+    std::ifstream in(p.rstfile);
+    std::stringstream text;
+    text << in.rdbuf();
+    return text.str();
+}
+
+/* The number following the first occurrence of key, -1 if there is none */
+double
+stat(const std::string& rst, const std::string& key)
+{
+    size_t at = rst.find(key);
+    if (at == std::string::npos)
+        return -1;
+    return strtod(rst.c_str() + at + key.size(), NULL);
+}
+
+/* Address in the default geometry, for traces built without a system */
+AddrT
+address(int chip, int tile, int block, int row, int col)
+{
+    return ((((AddrT)chip * n_tiles + tile) * n_blocks + block) * n_rows + row) * n_cols + col;
+}
+
+/* Element idx of a vector packed ncols/bits elements per row from base */
+AddrT
+elem(AddrT base, uint64_t idx, int bits)
+{
+    int per_row = n_cols / bits;
+    return base + (AddrT)(idx / per_row) * n_cols + (idx % per_row) * bits;
+}
+
+/* Rows of packed storage needed for n elements */
+AddrT
+rows(uint64_t n, int bits)
+{
+    int per_row = n_cols / bits;
+    return (n + per_row - 1) / per_row;
+}
+
+/* Record g of a table whose blocks are dealt round robin to the chips,
+ * starting at block first_block of every chip */
+AddrT
+record(System& sys, int first_block, uint64_t g, int col)
+{
+    uint64_t b = g / n_rows;
+    int local = first_block + b / n_chips;
+    return sys.getAddress(b % n_chips, local / n_blocks, local % n_blocks, g % n_rows, col);
+}
+
+/* Row additions over the first rows of one block */
+Request
+rowAdds(System& sys, int chip, int block, int n)
+{
+    Request req(Request::Type::RowAdd);
+    for (int r = 0; r < n; r++)
+        req.addAddr(sys.getAddress(chip, 0, block, r, 0), 2 * 32);
+    return req;
+}
+
+int
+checkCtrl(Config& config)
+{
+    /* Misses walking the rows of block 1 interleaved with hits on the open
+     * row of block 0: everything issues once, and FR-FCFS lets the hits
+     * pass the older misses */
+    std::string rst = report(config, point(), [](System& sys) {
+        sys.setCtrlQueues(true);
+        Request req(Request::Type::RowAdd);
+        for (int r = 0; r < 16; r++) {
+            req.addAddr(sys.getAddress(0, 0, 1, r, 0), 2 * 32);
+            req.addAddr(sys.getAddress(0, 0, 0, 0, 0), 2 * 32);
+        }
+        sys.sendRequest(req);
+    });
+    return (stat(rst, "Issued requests: ") != 32) + (stat(rst, "Open-row hits: ") < 15)
+         + (stat(rst, "Issued ahead of older requests: ") <= 0);
+}
+
+int
+checkPower(Config& config)
+{
+    auto work = [](System& sys) {
+        for (int i = 0; i < 200; i++) {
+            Request req = rowAdds(sys, 0, i % n_blocks, 4);
+            sys.sendRequest(req);
+        }
+    };
+    /* A cap far above the draw measures the uncapped power */
+    std::string free_run = report(config, point(), [&](System& sys) {
+        sys.setPowerCap(1e9, 0, 1000);
+        work(sys);
+    });
+    double cap = stat(free_run, "Chip#0: avg ") / 2;
+    std::string capped = report(config, point(), [&](System& sys) {
+        sys.setPowerCap(cap, 0, 1000);
+        work(sys);
+    });
+    /* The last window may overshoot by what was in flight */
+    return (stat(free_run, "throttled ") != 0) + (stat(capped, "throttled ") <= 0)
+         + (stat(capped, "Chip#0: avg ") > cap * 1.25)
+         + (stat(capped, "Chip#0 has ticked ") <= stat(free_run, "Chip#0 has ticked "));
+}
+
+int
+checkDesignSpace(Config& config)
+{
+    std::vector<Request> trace;
+    for (int i = 0; i < 8; i++) {
+        Request add(Request::Type::RowAdd);
+        add.addAddr(address(i % 2, 0, 1, i, 0), 2 * 32);
+        trace.push_back(add);
+    }
+    Request move(Request::Type::SystemRow2Row);
+    move.addAddr(address(0, 0, 6, 0, 0), 64);
+    move.addAddr(address(1, 0, 6, 0, 0), 64);
+    trace.push_back(move);
+
+    /* The single chip cannot hold the trace */
+    std::vector<System::DesignPoint> points = {
+        point(2, "ideal", "/dev/null"), point(4, "mesh", "/dev/null"), point(1, "ideal", "/dev/null")
+    };
+    std::vector<System::DesignResult> res = System::exploreDesignSpace(&config, points, trace, 2, NULL);
+    int bad = res.size() != points.size();
+    for (size_t i = 0; !bad && i < 2; i++)
+        bad += !res[i].ok + (res[i].cycles == 0) + (res[i].net_reqs == 0);
+    if (!bad)
+        bad += res[2].ok + !(res[0].pareto || res[1].pareto);
+    return bad;
+}
+
+int
+checkLazyChips(Config& config)
+{
+    /* Chips never addressed still follow the system clock */
+    std::string rst = report(config, point(4), [](System& sys) {
+        Request req = rowAdds(sys, 0, 0, 16);
+        sys.sendRequest(req);
+    });
+    double busy = stat(rst, "Chip#0 has ticked ");
+    return (busy <= 0) + (stat(rst, "Chip#3 has ticked ") != busy);
+}
+
+int
+checkFunctional(Config& config)
+{
+    /* One 16-bit operation of each kind per row of block 0, and down the
+     * columns of block 1 */
+    const int w = 16;
+    const struct {
+        Request::Type row, col;
+        uint64_t a, b, want;
+    } ops[] = {
+        {Request::Type::RowAdd, Request::Type::ColAdd, 1234, 4321, 5555},
+        {Request::Type::RowSub, Request::Type::ColSub, 5000, 1234, 3766},
+        {Request::Type::RowMul, Request::Type::ColMul, 123, 45, 5535},
+        {Request::Type::RowDiv, Request::Type::ColDiv, 5000, 7, 714},
+    };
+    System sys(&config, point(1, "ideal", "/dev/null"));
+    sys.setFunctional(true);
+    int bad = 0;
+    for (int k = 0; k < 4; k++) {
+        AddrT row = sys.getAddress(0, 0, 0, k, 0);
+        sys.writeValue(row, ops[k].a, w, true);
+        sys.writeValue(row + w, ops[k].b, w, true);
+        Request row_req(ops[k].row);
+        row_req.addAddr(row, 2 * w);
+        sys.sendRequest(row_req);
+        bad += sys.readValue(row + 2 * w, w, true) != ops[k].want;
+
+        AddrT col = sys.getAddress(0, 0, 1, 0, k);
+        sys.writeValue(col, ops[k].a, w, false);
+        sys.writeValue(col + (AddrT)w * n_cols, ops[k].b, w, false);
+        Request col_req(ops[k].col);
+        col_req.addAddr(col, 2 * w);
+        col_req.addAddr(col, 2 * w);
+        sys.sendRequest(col_req);
+        bad += sys.readValue(col + (AddrT)2 * w * n_cols, w, false) != ops[k].want;
+    }
+    return bad;
+}
+
+int
+checkPrecision(Config& config)
+{
+    auto run = [&](System::Precision p, const std::string& key) {
+        std::string rst = report(config, point(), [p](System& sys) {
+            sys.setPrecision(p);
+            Request req = rowAdds(sys, 0, 0, 8);
+            sys.sendRequest(req);
+        });
+        return stat(rst, key);
+    };
+    /* Floating point takes several bit-serial steps, on narrower fields
+     * for BF16 */
+    int bad = run(System::Precision::FP32, "Chip#0 has ticked ")
+           <= run(System::Precision::Int32, "Chip#0 has ticked ");
+    bad += run(System::Precision::BF16, "Chip#0 has consumed ")
+        >= run(System::Precision::FP32, "Chip#0 has consumed ");
+
+    /* A kernel's precision only applies to the kernel */
+    auto after_kernel = [&](bool reset) {
+        std::string rst = report(config, point(), [reset](System& sys) {
+            sys.setPrecision(System::Precision::FP32);
+            sys.matrix_mul_area_optimized(2, 2, 2, 2, System::Precision::Int8);
+            if (reset)
+                sys.setPrecision(System::Precision::FP32);
+            Request req = rowAdds(sys, 1, 0, 8);
+            sys.sendRequest(req);
+        });
+        return stat(rst, "Chip#1 has consumed ");
+    };
+    bad += after_kernel(false) != after_kernel(true);
+    return bad;
+}
+
+int
+checkPrefetch(Config& config)
+{
+    /* A transfer from chip 0 to chip 1 followed by work on chip 2: a
+     * prefetched transfer overlaps the work instead of preceding it */
+    auto run = [&](bool prefetch) {
+        return report(config, point(3), [prefetch](System& sys) {
+            Request move(Request::Type::SystemRow2Row);
+            for (int r = 0; r < 16; r++) {
+                move.addAddr(sys.getAddress(0, 0, 6, r, 0), 64);
+                move.addAddr(sys.getAddress(1, 0, 6, r, 0), 64);
+            }
+            if (prefetch)
+                sys.prefetch(move);
+            else
+                sys.sendRequest(move);
+            Request work = rowAdds(sys, 2, 0, 64);
+            sys.sendRequest(work);
+        });
+    };
+    std::string serial = run(false), overlapped = run(true);
+    return (stat(overlapped, "Chip#2 has ticked ") >= stat(serial, "Chip#2 has ticked "))
+         + (stat(overlapped, "Prefetched ") != 1);
+}
+
+int
+checkTranspose(System& sys)
+{
+    /* Within a chip and across chips */
+    const int n = 8, bits = 16;
+    AddrT src = sys.getAddress(0, 0, 0, 0, 10);
+    for (int i = 0; i < n; i++)
+        sys.writeValue(src + (AddrT)i * n_cols, 0x1234 + i * 77, bits, true);
+    int bad = 0;
+    for (AddrT dst : {sys.getAddress(0, 0, 3, 5, 100), sys.getAddress(1, 0, 2, 0, 7)}) {
+        bad += sys.transpose(src, dst, n, bits) < 0;
+        for (int i = 0; i < n; i++)
+            bad += sys.readValue(dst + i, bits, false) != (uint64_t)(0x1234 + i * 77);
+    }
+    /* A tile running off its block is rejected */
+    bad += sys.transpose(src, sys.getAddress(0, 0, 3, 0, n_cols - 2), n, bits) != -1;
+    return bad;
+}
+
+int
+checkScan(System& sys)
+{
+    /* Row records over three blocks, then column records in one block */
+    const uint64_t n = 3 * n_rows;
+    uint64_t want = 0;
+    for (uint64_t g = 0; g < n; g++) {
+        uint64_t v = g % 5 ? g : 42;
+        want += v == 42;
+        sys.writeValue(record(sys, 0, g, 0), v, 32, true);
+    }
+    int bad = sys.scan(0, n, 32, 42, true).matches != want;
+
+    int block = 4;
+    AddrT base = record(sys, block, 0, 0);
+    want = 0;
+    for (int col = 0; col < n_cols; col++) {
+        uint64_t v = col % 3 ? col : 7;
+        want += v == 7;
+        sys.writeValue(base + col, v, 16, false);
+    }
+    bad += sys.scan(block, n_cols, 16, 7, false).matches != want;
+    /* More records than fit, or no such block: nothing is scanned */
+    bad += sys.scan(block, (uint64_t)n_chips * n_blocks * n_rows, 16, 7, true).records != 0;
+    bad += sys.scan(-1, 16, 16, 7, true).records != 0;
+    return bad;
+}
+
+int
+checkSpmv(System& sys)
+{
+    /* Storage starts after the PIM blocks: the nonzero values, then the
+     * x vectors and the y vectors, see spmv_csr() */
+    const int bits = 32, m = 60, n = 50, n_vecs = 2;
+    std::mt19937 rng(5);
+    std::vector<int> r, c;
+    std::vector<uint64_t> v;
+    for (int i = 0; i < m; i++) {
+        int k = i == 9 ? 300 : rng() % 6;         // one long row spans segments
+        for (int j = 0; j < k; j++) {
+            r.push_back(i);
+            c.push_back(rng() % n);
+            v.push_back(rng() % 100);
+        }
+    }
+    int pim_blocks = n_tiles * n_blocks * 3 / 4;
+    AddrT a_base = sys.getAddress(0, pim_blocks / n_blocks, pim_blocks % n_blocks, 0, 0);
+    AddrT x_base = a_base + rows(v.size(), bits) * n_cols;
+    AddrT y_base = x_base + n_vecs * rows(n, bits) * n_cols;
+    std::vector<uint64_t> x((size_t)n_vecs * n);
+    for (int k = 0; k < n_vecs; k++)
+        for (int j = 0; j < n; j++) {
+            x[k * n + j] = rng() % 100;
+            sys.writeValue(elem(x_base + k * rows(n, bits) * n_cols, j, bits), x[k * n + j], bits, true);
+        }
+    sys.spmv_coo(m, n, r, c, v, n_vecs);
+
+    int bad = 0;
+    for (int k = 0; k < n_vecs; k++)
+        for (int i = 0; i < m; i++) {
+            uint64_t want = 0;
+            bool empty = true;
+            for (size_t nz = 0; nz < v.size(); nz++)
+                if (r[nz] == i) {
+                    want += v[nz] * x[k * n + c[nz]];
+                    empty = false;
+                }
+            uint64_t got = sys.readValue(elem(y_base + k * rows(m, bits) * n_cols, i, bits), bits, true);
+            bad += !empty && (uint32_t)want != got;
+        }
+    return bad;
+}
+
+/* One convolution; the shape decides which mapping conv2d picks */
+int
+checkConv(System& sys, int N, int C, int H, int W, int K, int R, int S, int stride)
+{
+    /* Storage after the PIM blocks holds the input (NCHW), the filters
+     * (K x CRS) and the output (NKPQ), see conv2d() */
+    const int bits = 32;
+    int P = (H - R) / stride + 1, Q = (W - S) / stride + 1, taps = C * R * S;
+    int pim_blocks = n_tiles * n_blocks * 3 / 4;
+    AddrT x_base = sys.getAddress(0, pim_blocks / n_blocks, pim_blocks % n_blocks, 0, 0);
+    AddrT w_base = x_base + rows((uint64_t)N * C * H * W, bits) * n_cols;
+    AddrT y_base = w_base + rows((uint64_t)K * taps, bits) * n_cols;
+    std::mt19937 rng(7);
+    std::vector<uint64_t> x((size_t)N * C * H * W), w((size_t)K * taps);
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = rng() % 20;
+        sys.writeValue(elem(x_base, i, bits), x[i], bits, true);
+    }
+    for (size_t i = 0; i < w.size(); i++) {
+        w[i] = rng() % 20;
+        sys.writeValue(elem(w_base, i, bits), w[i], bits, true);
+    }
+    sys.conv2d(N, C, H, W, K, R, S, stride);
+
+    int bad = 0;
+    for (int n = 0; n < N; n++)
+    for (int k = 0; k < K; k++)
+    for (int op = 0; op < P; op++)
+    for (int oq = 0; oq < Q; oq++) {
+        uint64_t want = 0;
+        for (int c = 0; c < C; c++)
+            for (int r = 0; r < R; r++)
+                for (int s = 0; s < S; s++)
+                    want += w[(size_t)k * taps + (c * R + r) * S + s]
+                          * x[(((size_t)n * C + c) * H + op * stride + r) * W + oq * stride + s];
+        AddrT y = elem(y_base, (((uint64_t)n * K + k) * P + op) * Q + oq, bits);
+        bad += sys.readValue(y, bits, true) != want;
+    }
+    return bad;
+}
+
+int
+checkConv2d(Config& config)
+{
+    /* Few filters over many pixels map to im2col, many filters directly */
+    int bad = 0;
+    std::string rst = report(config, point(), [&bad](System& sys) {
+        sys.setFunctional(true);
+        bad += checkConv(sys, 1, 1, 4, 4, 2, 3, 3, 1) + checkConv(sys, 2, 3, 7, 5, 20, 2, 2, 2);
+    });
+    bad += rst.find("Mapping: im2col") == std::string::npos;
+    bad += rst.find("Mapping: direct") == std::string::npos;
+    return bad;
+}
+
+int
+checkSort(System& sys)
+{
+    const int bits = 12;
+    const uint64_t n = 1000;
+    std::mt19937 rng(1);
+    std::vector<uint64_t> keys(n), got(n);
+    for (uint64_t g = 0; g < n; g++) {
+        keys[g] = rng() % (1 << bits);
+        sys.writeValue(record(sys, 0, g, 0), keys[g], bits, true);
+    }
+    sys.sort(0, n, bits);
+    for (uint64_t g = 0; g < n; g++)
+        got[g] = sys.readValue(record(sys, 0, g, 0), bits, true);
+    std::sort(keys.begin(), keys.end());
+    int bad = 0;
+    for (uint64_t g = 0; g < n; g++)
+        bad += keys[g] != got[g];
+    return bad;
+}
+
+/* Kernel checks run in functional mode on a system of their own */
+template <int (*check)(System&)>
+int
+functional(Config& config)
+{
+    System sys(&config, point(n_chips, "ideal", "/dev/null"));
+    sys.setFunctional(true);
+    return check(sys);
+}
+
+int
+checkEstimator(Config& config)
+{
+    std::vector<Request> trace;
+    for (int i = 0; i < 24; i++) {
+        Request add(i % 3 ? Request::Type::RowAdd : Request::Type::RowMul);
+        for (int r = 0; r < 8; r++)
+            add.addAddr(address(i % 2, 0, i % 4, r, 0), 2 * 32);
+        trace.push_back(add);
+        if (i % 6 == 5) {
+            Request move(Request::Type::SystemRow2Row);
+            move.addAddr(address(0, 0, 6, i, 0), 64);
+            move.addAddr(address(1, 0, 6, i, 0), 64);
+            trace.push_back(move);
+        }
+    }
+    System::Estimate est, again;
+    std::string rst = report(config, point(), [&](System& sys) {
+        sys.calibrateEstimator(std::vector<Request>(trace.begin(), trace.begin() + 8));
+        est = sys.estimate(trace);
+        again = sys.estimate(trace);
+        for (Request req : trace)
+            sys.sendRequest(req);
+    });
+    /* Estimates are repeatable and near the simulated time */
+    double cycles = stat(rst, "Chip#0 has ticked ");
+    return (est.cycles != again.cycles) + (est.energy != again.energy)
+         + (std::fabs(est.cycles - cycles) > 0.25 * cycles);
+}
+
+int
+checkMigration(Config& config)
+{
+    /* Only blocks 0 and 1 of chip 0 are busy, so one of them moves to the
+     * idle chip; its data has to move along */
+    int bad = 0;
+    std::string rst = report(config, point(), [&bad](System& sys) {
+        sys.setFunctional(true);
+        sys.setMigration(true, 1.5, 64);
+        for (int b = 0; b < 2; b++)
+            for (int r = 0; r < 16; r++)
+                sys.writeValue(sys.getAddress(0, 0, b, r, 0), 1000 * b + r, 32, true);
+        for (int i = 0; i < 64; i++) {
+            Request search(Request::Type::RowSearch);
+            for (int r = 0; r < 16; r++)
+                search.addAddr(sys.getAddress(0, 0, i % 2, r, 0), 2 * 32);
+            sys.sendRequest(search);
+        }
+        for (int b = 0; b < 2; b++)
+            for (int r = 0; r < 16; r++)
+                bad += sys.readValue(sys.getAddress(0, 0, b, r, 0), 32, true) != (uint64_t)(1000 * b + r);
+    });
+    /* Once moved, the two blocks load both chips evenly */
+    bad += stat(rst, "Migrations: ") <= 0;
+    bad += stat(rst, "last window: ") >= stat(rst, "before the first migration: ");
+    return bad;
+}
+
+int
+checkSync(Config& config)
+{
+    /* A transfer between chips 0 and 1 is left in flight, then chip 1 and
+     * chips 60-69 are brought to a common time; the other chips are not */
+    std::string rst = report(config, point(70, "mesh"), [](System& sys) {
+        Request send(Request::Type::NetworkSend);
+        send.addAddr(sys.getAddress(0, 0, 0, 0, 0), 256);
+        send.addAddr(sys.getAddress(1, 0, 0, 0, 0), 256);
+        sys.prefetch(send);
+        sys.sync({1, 60, 61, 62, 63, 64, 65, 66, 67, 68, 69});
+    });
+    double synced = stat(rst, "Chip#1 has ticked ");
+    return (synced <= 0) + (stat(rst, "Chip#65 has ticked ") != synced)
+         + (stat(rst, "Chip#2 has ticked ") != 0);
+}
+
+int
+checkTopology(Config& config)
+{
+    /* Diameter of 16 chips, and a transfer between the farthest ones:
+     * head latency plus 256 bits over the narrowest link */
+    const struct {
+        const char* scheme;
+        int diameter, latency;
+    } nets[] = {
+        {"torus:dims=4x4", 4, 2 * 4 + 4},
+        {"fattree:radix=4", 8, 8 * 4 + 4},
+        {"hier:board=4:rack=2", 6, 2 * 2 + 2 * 8 + 2 * 32 + 4},
+    };
+    int bad = 0;
+    for (const auto& net : nets) {
+        int ticks = 0;
+        std::string rst = report(config, point(16, net.scheme), [&ticks](System& sys) {
+            Request send(Request::Type::NetworkSend);
+            send.addAddr(sys.getAddress(0, 0, 0, 0, 0), 256);
+            send.addAddr(sys.getAddress(15, 0, 0, 0, 0), 256);
+            ticks = sys.sendRequest(send);
+        });
+        bad += (stat(rst, "diameter ") != net.diameter) + (ticks != net.latency);
+    }
+    return bad;
+}
+
+#if defined(__cpp_impl_coroutine)
+System::Kernel
+addKernel(System& sys, int chip, int steps)
+{
+    for (int i = 0; i < steps; i++)
+        co_await sys.submit(rowAdds(sys, chip, 0, 8));
+}
+
+int
+checkKernels(Config& config)
+{
+    /* Two kernels on different chips share every round */
+    std::string together = report(config, point(), [](System& sys) {
+        sys.spawn(addKernel(sys, 0, 8));
+        sys.spawn(addKernel(sys, 1, 8));
+        sys.run();
+    });
+    std::string serial = report(config, point(), [](System& sys) {
+        for (int chip = 0; chip < 2; chip++)
+            for (int i = 0; i < 8; i++) {
+                Request req = rowAdds(sys, chip, 0, 8);
+                sys.sendRequest(req);
+            }
+    });
+    return (stat(together, "requests in ") != 8)
+         + (stat(together, "rounds, ") >= stat(serial, "Chip#0 has ticked "));
+}
+#endif
+
+/* Median latency reported for tenant name */
+double
+tenantP50(const std::string& rst, const std::string& name)
+{
+    size_t at = rst.find("Tenant " + name + ":");
+    return at == std::string::npos ? -1 : stat(rst.substr(at), "latency p50 ");
+}
+
+int
+checkTenants(Config& config)
+{
+    int bad = 0;
+    std::string rst = report(config, point(), [&bad](System& sys) {
+        sys.setFunctional(true);
+        sys.setCtrlQueues(true);
+        int a = sys.addTenant("a", 0, 1, 0, 4, 1.0, true);
+        int b = sys.addTenant("b", 1, 1, 2, 4);
+        /* Block 1 of tenant b is block 3 of chip 1 */
+        sys.writeValue(sys.getAddress(1, 0, 3, 5, 0), 20, 16, true);
+        sys.writeValue(sys.getAddress(1, 0, 3, 5, 16), 22, 16, true);
+        Request add(Request::Type::RowAdd);
+        add.addAddr(sys.tenantAddress(b, 0, 1, 5, 0), 2 * 16);
+        sys.sendRequest(b, add);
+        bad += sys.readValue(sys.getAddress(1, 0, 3, 5, 32), 16, true) != 42;
+        bad += sys.sendRequest(7, add) != -1;
+        for (int i = 0; i < 16; i++) {
+            for (int t : {a, b}) {
+                Request req(Request::Type::RowMul);
+                for (int r = 0; r < 8; r++)
+                    req.addAddr(sys.tenantAddress(t, 0, i % 4, r, 0), 2 * 32);
+                sys.sendRequest(t, req);
+            }
+        }
+    });
+    /* Each tenant is accounted its own requests; the latency-priority
+     * tenant is not the slower one */
+    double p50_a = tenantP50(rst, "a"), p50_b = tenantP50(rst, "b");
+    bad += stat(rst.substr(rst.find("Tenant b:")), "\n  ") != 17;
+    return bad + (p50_a < 0) + (p50_b < 0) + (p50_a > p50_b);
+}
+
+int
+checkProgram(Config& config)
+{
+    std::vector<Request> trace;
+    for (int i = 0; i < 12; i++) {
+        Request add(i % 2 ? Request::Type::RowAdd : Request::Type::ColAdd);
+        add.addAddr(address(i % 2, 0, i % 3, i, 0), 2 * 32);
+        add.addAddr(address(i % 2, 0, i % 3, i, 0), 2 * 32);
+        trace.push_back(add);
+        Request move(Request::Type::SystemRow2Row);
+        move.addAddr(address(0, 0, 6, i, 0), 64);
+        move.addAddr(address(1, 0, 5, i, 0), 64);
+        trace.push_back(move);
+    }
+    /* A compiled program runs exactly like the requests sent one by one */
+    std::string direct = report(config, point(), [&](System& sys) {
+        for (Request req : trace)
+            sys.sendRequest(req);
+    });
+    bool ok = false;
+    std::string compiled = report(config, point(), [&](System& sys) {
+        System::Program prog;
+        ok = sys.compile(trace, prog);
+        if (ok)
+            sys.runProgram(prog);
+    });
+    int bad = !ok;
+    bad += direct.substr(direct.find("Summary")) != compiled.substr(compiled.find("Summary"));
+    /* An address past the last chip does not compile */
+    Request wild(Request::Type::RowAdd);
+    wild.addAddr(address(n_chips, 0, 0, 0, 0), 2 * 32);
+    trace.push_back(wild);
+    System sys(&config, point(n_chips, "ideal", "/dev/null"));
+    System::Program prog;
+    bad += sys.compile(trace, prog);
+    return bad;
+}
+
+int
+checkCompression(Config& config)
+{
+    auto run = [&](bool functional, System::Compression scheme, double ratio) {
+        return report(config, point(), [=](System& sys) {
+            sys.setFunctional(functional);
+            sys.setCompression(scheme);
+            if (ratio > 0)
+                sys.setCompressionRatio(sys.getAddress(0, 0, 6, 0, 0), sys.getAddress(0, 0, 7, 0, 0), ratio);
+            Request move(Request::Type::SystemRow2Row);
+            for (int r = 0; r < 8; r++) {
+                move.addAddr(sys.getAddress(0, 0, 6, r, 0), 256);
+                move.addAddr(sys.getAddress(1, 0, 6, r, 0), 256);
+            }
+            sys.sendRequest(move);
+        });
+    };
+    /* Blocks start out zeroed, which zero-run encoding shrinks */
+    std::string zeros = run(true, System::Compression::ZeroRun, 0);
+    int bad = stat(zeros, " raw, ") >= stat(zeros, "Transfer bits: ");
+    /* Without data, an assumed ratio applies to its region only */
+    std::string region = run(false, System::Compression::BaseDelta, 4.0);
+    bad += stat(region, " raw, ") > stat(region, "Transfer bits: ") / 2;
+    std::string none = run(false, System::Compression::ZeroRun, 0);
+    bad += (stat(none, "Compression: zero-run, ") != 0) + (stat(none, "Codec cycles: ") != 0);
+    return bad;
+}
+
+int
+checkLiveStats(Config& config)
+{
+    /* A reader follows the run from another thread until it finishes */
+    const char* name = "pimsim-regress";
+    const int n_reqs = 400;
+    FILE* out = tmpfile();
+    int status = -1;
+    {
+        System sys(&config, point(n_chips, "ideal", "/dev/null"));
+        if (!out || !sys.setLiveStats(name, n_reqs, 16))
+            return 1;
+        std::thread reader([&] { status = System::watchStats(name, 5, out); });
+        for (int i = 0; i < n_reqs; i++) {
+            Request req = rowAdds(sys, i % 2, i % n_blocks, 4);
+            sys.sendRequest(req);
+        }
+        sys.finish();
+        reader.join();
+    }
+    /* "[time] N reqs, ..." per line, never going backwards */
+    int bad = status != 0;
+    long last = -1;
+    char line[1024];
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        const char* at = strstr(line, "] ");
+        long reqs = at ? strtol(at + 2, NULL, 10) : -1;
+        bad += reqs < last;
+        last = reqs;
+    }
+    fclose(out);
+    return bad + (last != n_reqs);
+}
+
+struct Check {
+    const char* name;
+    int (*run)(Config& config);
+};
+
+const Check checks[] = {
+    {"ctrl", checkCtrl},
+    {"power", checkPower},
+    {"dse", checkDesignSpace},
+    {"lazy", checkLazyChips},
+    {"functional", checkFunctional},
+    {"precision", checkPrecision},
+    {"prefetch", checkPrefetch},
+    {"transpose", functional<checkTranspose>},
+    {"scan", functional<checkScan>},
+    {"spmv", functional<checkSpmv>},
+    {"conv2d", checkConv2d},
+    {"sort", functional<checkSort>},
+    {"estimator", checkEstimator},
+    {"migration", checkMigration},
+    {"sync", checkSync},
+    {"topology", checkTopology},
+#if defined(__cpp_impl_coroutine)
+    {"kernels", checkKernels},
+#endif
+    {"tenants", checkTenants},
+    {"program", checkProgram},
+    {"compression", checkCompression},
+    {"livestats", checkLiveStats},
+};
+
+}
+
+int
+main(int argc, char** argv)
+{
+    Config config;
+    int failed = 0;
+    for (const Check& check : checks) {
+        bool wanted = argc < 2;
+        for (int i = 1; i < argc; i++)
+            wanted = wanted || !strcmp(argv[i], check.name);
+        if (!wanted)
+            continue;
+        int bad = check.run(config);
+        printf("%-12s %s", check.name, bad ? "FAIL" : "ok");
+        if (bad)
+            printf(", %d failed", bad);
+        printf("\n");
+        failed += bad > 0;
+    }
+    remove(rst_name);
+    return failed ? 1 : 0;
+}
@@ -1,6 +1,22 @@
 #include "backend/System.h"
 
 #include "backend/MemoryBlock.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 using namespace pimsim;
 using namespace std;
 
@@ -12,41 +28,25 @@ System::System(Config* config)
     _nblocks = _config->get_nblocks();
     _nrows = config->get_nrows();
     _ncols = config->get_ncols();
-    _clock_rate = config->get_clock_rate();
-    _blockctrl = config->get_blockctrl();
-    _tilectrl = config->get_tilectrl();
-    _chipctrl = config->get_chipctrl();
-    _force_sync = config->getSync();
-    if (!(_blockctrl || _tilectrl || _chipctrl))
-        _blockctrl = true;
-    _blocksize = _nrows * _ncols; // set the banksize based on columns and rows
-    rstFile = fopen(config->get_rstfile().c_str(), "w");
-
-    _values = new MemoryCharacteristics();
-    for (int i = 0; i < _nchips; i++) {
-        MemoryChip* chip = new MemoryChip(_ntiles, _nblocks, _nrows, _ncols, _clock_rate);
-        Controller* ctrl = new Controller(chip);
-        chip->setId(i);
-        chip->setController(ctrl, _clock_rate);
-        chip->setParent(NULL);
-        chip->setValues(_values);
-        _chips.push_back(chip);
-    }
-    /* Network connection */
-    GlobalConnection::Type nt;
-    if (_config->get_netscheme() == "mesh") {
-        nt = GlobalConnection::Type::Mesh;
-    } else if (_config->get_netscheme() == "dragonfly") {
-        nt = GlobalConnection::Type::Dragonfly;
-    } else {
-        nt = GlobalConnection::Type::Ideal;
-    }
-    _conn = new GlobalConnection(this, nt); 
+    _netscheme = config->get_netscheme();
+    _rstname = config->get_rstfile();
+    init();
 }
 
 System::~System() 
 {
+#if defined(__cpp_impl_coroutine)
+    for (auto h : _kernels)
+        h.destroy();
+#endif
+    closeLiveStats();
     fclose(rstFile);
+    delete _probe;
+    delete _conn;
+    for (MemoryChip* chip : _chips)
+        if (chip)
+            delete chip;
+    delete _values;
 }
 
 void
@@ -59,6 +59,13 @@ System::addChip(MemoryCharacteristics* values, int n_tiles, int n_blocks, int n_
     chip->setParent(NULL);
     chip->setValues(values);
     _chips.push_back(chip);
+    _chip_clock.push_back(0);
+    _idle_energy.push_back(0.0);
+    if ((size_t)global_chip_id / 64 >= _all_chips.size()) {
+        _all_chips.push_back(0);
+        _busy_chips.push_back(0);
+    }
+    _all_chips[global_chip_id / 64] |= 1ULL << (global_chip_id % 64);
 }
 
 AddrT
@@ -95,6 +102,9 @@ System::getLocation(AddrT addr,
     tile_idx = addr % _ntiles; 
     addr /= _ntiles;
     chip_idx = addr % _nchips;
+    /* Blocks moved by the migration policy, see balanceBlocks() */
+    if (!_block_map.empty() && !_migrating)
+        remapBlock(chip_idx, tile_idx, block_idx);
 }
     
 void
@@ -114,21 +124,14 @@ System::getLocation(AddrT addr,
 }
 
 int
-System::sendMoReq(Request& req) 
+System::sendMoReq(Request& req, const Location* locs) 
 {
     int tot_clks = 0;
     int chip_idx = 0, tile_idx = 0, block_idx = 0, row_idx = 0, col_idx = 0;
-    AddrT addr = req.addr_list[0];
-    getLocation(addr, chip_idx, tile_idx, block_idx, row_idx, col_idx);
+    locate(req, locs, 0, chip_idx, tile_idx, block_idx, row_idx, col_idx);
     req.setLocation(chip_idx, tile_idx, block_idx, row_idx, col_idx);
 
-    tot_clks++;
-    bool res = _chips[chip_idx]->receiveReq(req);
-    while (!res) {
-        tot_clks++;
-        _chips[chip_idx]->tick();
-        res = _chips[chip_idx]->receiveReq(req);
-    }
+    tot_clks += issueReq(req, chip_idx, tile_idx, block_idx, row_idx);
     return tot_clks;
 }
 
@@ -141,32 +144,36 @@ System::sendNetReq(Request& req)
     getLocation(req.addr_list[1], cp2, tl2, bk2, r2, c2);
     req.setLocation(cp1, tl1, bk1, r1, c1);
 
-    int net_overhead = _conn->getLatency(cp1, cp2, req.size_list[0]);
-
-    TimeT sync_time = _chips[cp1]->getTime();
-    if (_chips[cp2]->getTime() > sync_time)
-        sync_time = _chips[cp2]->getTime();
-    int tick1 = 0, tick2 = 0;
-    while (_chips[cp1]->getTime() < sync_time) {
-        tick1++;
-        _chips[cp1]->tick();
-    }
-    while (_chips[cp2]->getTime() < sync_time + net_overhead) {
-        tick2++;
-        _chips[cp2]->tick();
-    }
+    int net_overhead = netLatency(cp1, cp2, req.size_list[0]);
+    if (_estimating)
+        return estimateNet(cp1, cp2, net_overhead);
+    drainCtrl(cp1);
+    drainCtrl(cp2);
+
+    TimeT sync_time = std::max(chipTime(cp1), chipTime(cp2));
+    if (_cur_tenant >= 0)
+        net_overhead += arbitrateNet(cp1, cp2, sync_time, 
+                netSerialize(cp1, cp2, req.size_list[0]));
+    int tick1 = advanceChip(cp1, sync_time);
+    int tick2 = advanceChip(cp2, sync_time + net_overhead);
+    _busy_chips[cp1 / 64] |= 1ULL << (cp1 % 64);
+    _busy_chips[cp2 / 64] |= 1ULL << (cp2 % 64);
 #ifdef NET_DEBUG_OUTPUT
     printf("Send a network request from Chip#%d to Chip#%d at %lu with %d overhead!\n",
             cp1, cp2, sync_time, net_overhead);
 #endif
     _conn->issueNetReq(cp1, cp2, req.size_list[0], tick1, tick2, net_overhead);
+    _net_reqs++;
+    /* Sizes are in bits */
+    _net_bytes += (req.size_list[0] + 7) / 8;
+    _net_clks += net_overhead;
     if (tick1 > tick2) 
         return tick1;
     return tick2;
 }
 
 int 
-System::sendRowMv(Request& req)
+System::sendRowMv(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -178,8 +185,8 @@ System::sendRowMv(Request& req)
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         if ((src_chip != dst_chip) || (src_tile != dst_tile) || (src_block != dst_block))
@@ -194,19 +201,13 @@ System::sendRowMv(Request& req)
         rm_req.addAddr(dst_addr, dst_size);
         rm_req.setLocation(src_chip, src_tile, src_block, src_row, -1);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(rm_req);
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(rm_req);
-        }
+        tot_clks += issueReq(rm_req, src_chip, src_tile, src_block, src_row);
     }
     return tot_clks;
 }
 
 int
-System::sendColMv(Request& req)
+System::sendColMv(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -218,8 +219,8 @@ System::sendColMv(Request& req)
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         if ((src_chip != dst_chip) || (src_block != dst_block))
@@ -234,19 +235,13 @@ System::sendColMv(Request& req)
         cm_req.addAddr(dst_addr, dst_size);
         cm_req.setLocation(src_chip, src_tile, src_block, -1, src_col);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(cm_req);
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(cm_req);
-        }
+        tot_clks += issueReq(cm_req, src_chip, src_tile, src_block, -1);
     }
     return tot_clks;
 }
 
 int
-System::sendRowPIM(Request& req)
+System::sendRowPIM(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -254,28 +249,25 @@ System::sendRowPIM(Request& req)
         AddrT src_addr = req.addr_list[i];
         int src_chip = 0, src_tile= 0, src_block= 0, src_row = 0, src_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
-        Request pim_req(req.type);
-
-        pim_req.addAddr(src_addr, req.size_list[i]);
-        pim_req.setLocation(src_chip, src_tile, src_block, src_row, -1);
+        vector<pair<Request::Type, int>> ops;
+        precisionOps(req.type, req.size_list[i], ops);
+        for (auto& op : ops) {
+            Request pim_req(op.first);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(pim_req);
+            pim_req.addAddr(src_addr, op.second);
+            pim_req.setLocation(src_chip, src_tile, src_block, src_row, -1);
 
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(pim_req);
+            tot_clks += issueReq(pim_req, src_chip, src_tile, src_block, src_row);
         }
     }
     return 0;
 }
 
 int
-System::sendColPIM(Request& req)
+System::sendColPIM(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -283,27 +275,25 @@ System::sendColPIM(Request& req)
        AddrT src_addr = req.addr_list[i];
         int src_chip = 0, src_tile= 0, src_block= 0, src_row = 0, src_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
-        Request pim_req(req.type);
+        vector<pair<Request::Type, int>> ops;
+        precisionOps(req.type, req.size_list[i], ops);
+        for (auto& op : ops) {
+            Request pim_req(op.first);
 
-        pim_req.addAddr(src_addr, req.size_list[i]);
-        pim_req.setLocation(src_chip, src_tile, src_block, -1, src_col);
+            pim_req.addAddr(src_addr, op.second);
+            pim_req.setLocation(src_chip, src_tile, src_block, -1, src_col);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(pim_req);
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(pim_req);
+            tot_clks += issueReq(pim_req, src_chip, src_tile, src_block, -1);
         }
     }
     return 0;
 }
 
 int
-System::sendRowBuffer(Request& req)
+System::sendRowBuffer(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -312,7 +302,7 @@ System::sendRowBuffer(Request& req)
         int src_size  = req.size_list[i];
         int src_chip = 0, src_tile= 0, src_block= 0, src_row = 0, src_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         //DELETE printf("sendrowbuffer src %lu\n", src_addr);
@@ -323,19 +313,13 @@ System::sendRowBuffer(Request& req)
         buf_req.addAddr(src_addr, src_size);
         buf_req.setLocation(src_chip, src_tile, src_block, src_row, -1);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(buf_req);
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(buf_req);
-        }
+        tot_clks += issueReq(buf_req, src_chip, src_tile, src_block, src_row);
     }
     return tot_clks;
 }
 
 int
-System::sendColBuffer(Request& req)
+System::sendColBuffer(Request& req, const Location* locs)
 {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
@@ -344,7 +328,7 @@ System::sendColBuffer(Request& req)
         int src_size  = req.size_list[i];
         int src_chip = 0, src_tile= 0, src_block= 0, src_row = 0, src_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         //cout<<"sendcolbuffer src %lu\n"<< src_addr<<endl;
@@ -357,27 +341,21 @@ System::sendColBuffer(Request& req)
         buf_req.addAddr(src_addr, src_size);
         buf_req.setLocation(src_chip, src_tile, src_block, -1, src_col);
 
-        tot_clks++;
-        bool res = _chips[src_chip]->receiveReq(buf_req);
-        while (!res) {
-            tot_clks++;
-            _chips[src_chip]->tick();
-            res = _chips[src_chip]->receiveReq(buf_req);
-        }
+        tot_clks += issueReq(buf_req, src_chip, src_tile, src_block, -1);
     }
     return tot_clks;
 }
 
 int
-System::sendPimReq(Request& req) 
+System::sendPimReq(Request& req, const Location* locs) 
 {
     int return_value = 0;
     switch (req.type) {
         case Request::Type::RowMv:
-            return_value =  sendRowMv(req);
+            return_value =  sendRowMv(req, locs);
             break;
         case Request::Type::ColMv:
-            return_value =   sendColMv(req);
+            return_value =   sendColMv(req, locs);
             break;
         case Request::Type::RowAdd:
         case Request::Type::RowSub:
@@ -385,7 +363,7 @@ System::sendPimReq(Request& req)
         case Request::Type::RowDiv:
         case Request::Type::RowBitwise:
         case Request::Type::RowSearch:
-            return_value =  sendRowPIM(req);
+            return_value =  sendRowPIM(req, locs);
             break;
         case Request::Type::ColAdd:
         case Request::Type::ColSub:
@@ -393,7 +371,7 @@ System::sendPimReq(Request& req)
         case Request::Type::ColDiv:
         case Request::Type::ColBitwise:
         case Request::Type::ColSearch: 
-            return_value =   sendColPIM(req);
+            return_value =   sendColPIM(req, locs);
             break;
         default:
             cout << "Error: cannot handle non-PIM operations here!\n";
@@ -404,16 +382,28 @@ System::sendPimReq(Request& req)
 
 int
 System::sendRequest(Request& req) 
+{
+    int ticks = dispatchRequest(req);
+    completeRequests();
+    return ticks;
+}
+
+int
+System::dispatchRequest(Request& req, const Location* locs)
 {
 #ifdef DEBUG_OUTPUT
     // std::cout << "The system is sending a request - " ;
 #endif
     int ticks = 0;
     tot_reqs++;
+    if (_live && !_estimating)
+        countLiveStats(req.type);
+    if (_functional && !_estimating)
+        funcExec(req);
     switch (req.type) {
         case Request::Type::Read:
         case Request::Type::Write:
-            ticks = sendMoReq(req);
+            ticks = sendMoReq(req, locs);
             break;
         case Request::Type::RowMv:
         case Request::Type::ColMv:
@@ -429,15 +419,15 @@ System::sendRequest(Request& req)
         case Request::Type::ColBitwise:
         case Request::Type::RowSearch:
         case Request::Type::ColSearch:
-            ticks = sendPimReq(req);
+            ticks = sendPimReq(req, locs);
             break;
         case Request::Type::RowBufferRead:
         case Request::Type::RowBufferWrite:
-            ticks =  sendRowBuffer(req);
+            ticks =  sendRowBuffer(req, locs);
             break;
         case Request::Type::ColBufferRead:
         case Request::Type::ColBufferWrite:
-            ticks =  sendColBuffer(req);
+            ticks =  sendColBuffer(req, locs);
             break;
         case Request::Type::NetworkSend:
         case Request::Type::NetworkReceive:
@@ -447,16 +437,16 @@ System::sendRequest(Request& req)
             ticks = sendNetReq(req);
             break;
         case Request::Type::SystemRow2Row:
-            ticks =  system_sendRow_receiveRow(req);
+            ticks =  system_sendRow_receiveRow(req, locs);
             break;
         case Request::Type::SystemRow2Col:
-            ticks =  system_sendRow_receiveCol(req);
+            ticks =  system_sendRow_receiveCol(req, locs);
             break;
         case Request::Type::SystemCol2Row:
-            ticks =  system_sendCol_receiveRow(req);
+            ticks =  system_sendCol_receiveRow(req, locs);
             break;
         case Request::Type::SystemCol2Col:
-            ticks =  system_sendCol_receiveCol(req);
+            ticks =  system_sendCol_receiveCol(req, locs);
             break;
         default:
             cout << "[Error] unrecognized request!\n";
@@ -473,58 +463,73 @@ System::sendRequest(Request& req)
         std::cout << "Wrong Address!" << std::endl;
         exit(1);
     }
-
-    vector<int> chips;
-    for (int i = 0; i < _nchips; i++) {
-        chips.push_back(i);
-        while (!_chips[i]->isFinished())
-            _chips[i]->tick();
-    }
-    sync(chips);
-
     return ticks;
 }
 
 void
-System::sync(vector<int> chips)
+System::completeRequests()
 {
-    TimeT max_time = 0;
-    for (int i : chips) {
-        if (_chips[i]->getTime() > max_time) {
-            max_time = _chips[i]->getTime();
-        }
-    }
-    for (int i : chips) {
-        while (_chips[i]->getTime() < max_time) {
-            _chips[i]->tick();
+    /* Only chips that were given work since the last call can have any
+     * left; the others are merely brought up to the common time */
+    for (size_t w = 0; w < _busy_chips.size(); w++) {
+        for (uint64_t m = _busy_chips[w]; m; m &= m - 1) {
+            int i = w * 64 + __builtin_ctzll(m);
+            drainCtrl(i);
+            if (!_chips[i])
+                continue;
+            while (!_chips[i]->isFinished())
+                _chips[i]->tick();
         }
-        _chips[i]->updateTime();
+        _busy_chips[w] = 0;
     }
+    syncSet(_all_chips);
+    /* Everything has drained, so blocks can move safely here */
+    if (_migrate && !_migrating && _window_ops >= _migrate_interval)
+        balanceBlocks();
+    if (_live && tot_reqs - _live_last >= _live_interval)
+        publishStats();
+}
+
+void
+System::sync(const vector<int>& chips)
+{
+    vector<uint64_t> set(_all_chips.size(), 0);
+    for (int i : chips)
+        set[i / 64] |= 1ULL << (i % 64);
+    syncSet(set);
 }
 
 void
 System::finish()
 {
     fprintf(rstFile, "\n############# Backend ##############\n");
-
-    for (int i = 0; i < _nchips; i++) {
-        while (!_chips[i]->isFinished())
-            _chips[i]->tick();
-        _chips[i]->outputStats(rstFile);
-    }
+    reportChips();
+    reportMigration();
+    reportTenants();
+    reportController();
+    reportPower();
 
     fprintf(rstFile, "\n############# Network #############\n");
+    reportTopology();
+    reportCompression();
     _conn->outputStat(rstFile);
 
     fprintf(rstFile, "\n############# Summary #############\n");
     for (int i = 0; i < _nchips; i++) {
-        fprintf(rstFile, "Chip#%d has ticked %lu clocks\n", i, _chips[i]->getTime());
-        fprintf(rstFile, "Chip#%d has consumed %.4lf nj energy\n", i, _chips[i]->getTotalEnergy());
+        fprintf(rstFile, "Chip#%d has ticked %lu clocks\n", i, chipTime(i));
+        fprintf(rstFile, "Chip#%d has consumed %.4lf nj energy\n", i, chipEnergy(i));
     }
+    if (_prefetch_reqs > 0)
+        fprintf(rstFile, "Prefetched %lu transfers\n", _prefetch_reqs);
+    if (_host_stalls > 0)
+        fprintf(rstFile, "Host admission stall cycles: %lu\n", _host_stalls);
+    /* The results are out, readers of the live stats can stop */
+    if (_live)
+        publishStats(true);
 }
 
 int 
-System::system_sendRow_receiveRow(Request& req) {
+System::system_sendRow_receiveRow(Request& req, const Location* locs) {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
     for (int i = 0; i < n_ops; i+=2) {
@@ -536,8 +541,8 @@ System::system_sendRow_receiveRow(Request& req) {
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         if ((src_col + src_size > _ncols) || (dst_col + dst_size > _ncols)) {
@@ -550,32 +555,26 @@ System::system_sendRow_receiveRow(Request& req) {
 #endif
             Request buffer_read_req(Request::Type::RowBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendRowBuffer(buffer_read_req);
-
-            Request net_send_req(Request::Type::NetworkSend);
-            net_send_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendNetReq(net_send_req);
+            tot_clks += sendRowBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
-            Request net_receive_req(Request::Type::NetworkReceive);
-            net_receive_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendNetReq(net_receive_req);
+            tot_clks += sendTransfer(src_addr, dst_addr, req.size_list[i], true);
 
             Request buffer_write_req(Request::Type::RowBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendRowBuffer(buffer_write_req);
+            tot_clks += sendRowBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else if ((src_tile != dst_tile) || (src_block != dst_block)) {
             Request buffer_read_req(Request::Type::RowBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendRowBuffer(buffer_read_req);
+            tot_clks += sendRowBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
             Request buffer_write_req(Request::Type::RowBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendRowBuffer(buffer_write_req);
+            tot_clks += sendRowBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else {
             Request row_mv_req(Request::Type::RowMv);
             row_mv_req.addAddr(src_addr, req.size_list[i]);
             row_mv_req.addAddr(dst_addr, req.size_list[i]);
-            tot_clks += sendRowMv(row_mv_req);
+            tot_clks += sendRowMv(row_mv_req, locs ? &locs[i] : NULL);
         }
     }
     return tot_clks;
@@ -721,7 +720,7 @@ void System::example_2() {
 /***************************************************************/
 
 int 
-System::system_sendRow_receiveCol(Request& req) {
+System::system_sendRow_receiveCol(Request& req, const Location* locs) {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
     for (int i = 0; i < n_ops; i+=2) {
@@ -733,8 +732,8 @@ System::system_sendRow_receiveCol(Request& req) {
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         if ((src_col+ src_size > _ncols) || (dst_row + dst_size > _nrows)) {
@@ -748,36 +747,30 @@ System::system_sendRow_receiveCol(Request& req) {
 #endif
             Request buffer_read_req(Request::Type::RowBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendRowBuffer(buffer_read_req);
+            tot_clks += sendRowBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
-            Request net_send_req(Request::Type::NetworkSend);
-            net_send_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendNetReq(net_send_req);
-
-            Request net_receive_req(Request::Type::NetworkReceive);
-            net_receive_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendNetReq(net_receive_req);
+            tot_clks += sendTransfer(src_addr, dst_addr, req.size_list[i], true);
 
             Request buffer_write_req(Request::Type::ColBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendColBuffer(buffer_write_req);
+            tot_clks += sendColBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else{
             //DELETEprintf("src %lu\n", src_addr);
             Request buffer_read_req(Request::Type::RowBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendRowBuffer(buffer_read_req);
+            tot_clks += sendRowBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
             //DELETEprintf("dst %lu\n", dst_addr);
             Request buffer_write_req(Request::Type::ColBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendColBuffer(buffer_write_req);
+            tot_clks += sendColBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         }
     }
     return tot_clks;
 }
     
 int 
-System::system_sendCol_receiveRow(Request& req) {
+System::system_sendCol_receiveRow(Request& req, const Location* locs) {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
     for (int i = 0; i < n_ops; i+=2) {
@@ -789,8 +782,8 @@ System::system_sendCol_receiveRow(Request& req) {
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
 
         if ((src_row+ src_size > _nrows) || (dst_col + dst_size > _ncols)) {
@@ -803,34 +796,28 @@ System::system_sendCol_receiveRow(Request& req) {
 #endif
             Request buffer_read_req(Request::Type::ColBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendColBuffer(buffer_read_req);
+            tot_clks += sendColBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
-            Request net_send_req(Request::Type::NetworkSend);
-            net_send_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendNetReq(net_send_req);
-
-            Request net_receive_req(Request::Type::NetworkReceive);
-            net_receive_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendNetReq(net_receive_req);
+            tot_clks += sendTransfer(src_addr, dst_addr, req.size_list[i], false);
 
             Request buffer_write_req(Request::Type::RowBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendRowBuffer(buffer_write_req);
+            tot_clks += sendRowBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else{
             Request buffer_read_req(Request::Type::ColBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendColBuffer(buffer_read_req);
+            tot_clks += sendColBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
             Request buffer_write_req(Request::Type::RowBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendRowBuffer(buffer_write_req);
+            tot_clks += sendRowBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         }
     }
     return tot_clks;
 }
     
 int 
-System::system_sendCol_receiveCol(Request& req) {
+System::system_sendCol_receiveCol(Request& req, const Location* locs) {
     int tot_clks = 0;
     int n_ops = req.addr_list.size();
     for (int i = 0; i < n_ops; i+=2) {
@@ -842,8 +829,8 @@ System::system_sendCol_receiveCol(Request& req) {
         int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
             dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
 
-        getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
-        getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+        locate(req, locs, i, src_chip, src_tile, src_block, src_row, src_col);
+        locate(req, locs, i+1, dst_chip, dst_tile, dst_block, dst_row, dst_col);
         req.setLocation(src_chip, src_tile, src_block, src_row, src_col);
             //cout<<"sendcolbuffer src %lu\n"<< src_row<<endl;
             //cout<<"sendcolbuffer size %lu\n"<< src_size<<endl;
@@ -858,193 +845,3929 @@ System::system_sendCol_receiveCol(Request& req) {
 #endif
             Request buffer_read_req(Request::Type::ColBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendColBuffer(buffer_read_req);
-
-            Request net_send_req(Request::Type::NetworkSend);
-            net_send_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendNetReq(net_send_req);
+            tot_clks += sendColBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
-            Request net_receive_req(Request::Type::NetworkReceive);
-            net_receive_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendNetReq(net_receive_req);
+            tot_clks += sendTransfer(src_addr, dst_addr, req.size_list[i], false);
 
             Request buffer_write_req(Request::Type::ColBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendColBuffer(buffer_write_req);
+            tot_clks += sendColBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else if ((src_tile != dst_tile) || (src_block != dst_block)) {
             Request buffer_read_req(Request::Type::ColBufferRead);
             buffer_read_req.addAddr(src_addr, req.size_list[i]);
-            tot_clks += sendColBuffer(buffer_read_req);
+            tot_clks += sendColBuffer(buffer_read_req, locs ? &locs[i] : NULL);
 
             Request buffer_write_req(Request::Type::ColBufferWrite);
             buffer_write_req.addAddr(dst_addr, req.size_list[i+1]);
-            tot_clks += sendColBuffer(buffer_write_req);
+            tot_clks += sendColBuffer(buffer_write_req, locs ? &locs[i+1] : NULL);
         } else {
             Request col_mv_req(Request::Type::ColMv);
             col_mv_req.addAddr(src_addr, req.size_list[i]);
             col_mv_req.addAddr(dst_addr, req.size_list[i]);
-            tot_clks += sendColMv(col_mv_req);
+            tot_clks += sendColMv(col_mv_req, locs ? &locs[i] : NULL);
         }
     }
     return tot_clks;
 }
 
-void System::matrix_mul_area_optimized(int A_row, int A_col, int B_row, int B_col) 
+namespace {
+
+bool
+isBufferOp(Request::Type type)
 {
-    AddrT storage_start_address =  (AddrT)_ncols *_nrows * _nblocks * _ntiles / 4 * 3; // use the last 3/4 for storage units
-    AddrT pim_start_address = 0;
+    return type == Request::Type::RowBufferRead || type == Request::Type::RowBufferWrite
+        || type == Request::Type::ColBufferRead || type == Request::Type::ColBufferWrite;
+}
 
-    int mul1_p = 0;
-    int height = 40;
-    int a_p    = mul1_p;
-    int b_p    = 2;
+}
 
-    AddrT data_a_p = 0;
-    AddrT data_b_p = (AddrT)200*_ncols*_nrows;
-    AddrT pim_p = 0;
-    AddrT sum_p = (AddrT)4000* (AddrT)_ncols* (AddrT)_nrows; //TODO
+int
+System::ctrlQueueIndex(int chip_idx, int tile_idx, int block_idx)
+{
+    if (_blockctrl)
+        return (chip_idx * _ntiles + tile_idx) * _nblocks + block_idx;
+    return chip_idx * _ntiles + tile_idx;
+}
 
+int
+System::issueReq(Request& req, int chip_idx, int tile_idx, int block_idx, int row_idx)
+{
+    int tot_clks = 1;
+    if (_estimating) {
+        estimateLeaf(req, chip_idx, tile_idx, block_idx);
+        return tot_clks;
+    }
+    _busy_chips[chip_idx / 64] |= 1ULL << (chip_idx % 64);
+    if (!_migrating) {
+        getChip(chip_idx);      // sizes the chip's counters on first touch
+        int unit = tile_idx * _nblocks + block_idx;
+        _block_ops[chip_idx][unit]++;
+        _block_window[chip_idx][unit]++;
+        _window_ops++;
+    }
+    if (!_hierctrl) {
+        tot_clks += throttlePower(chip_idx);
+        /* Single chip controller: retry until the chip admits the request */
+        MemoryChip* chip = getChip(chip_idx);
+        bool res = chip->receiveReq(req);
+        while (!res) {
+            tot_clks++;
+            /* Keep the live stats moving while the host spins here */
+            _host_stalls++;
+            if (_live && !(_host_stalls & 0xfffff))
+                publishStats();
+            chip->tick();
+            res = chip->receiveReq(req);
+        }
+        return tot_clks;
+    }
 
-    pim_p  = pim_start_address;
-    data_a_p = storage_start_address;
-    data_b_p = storage_start_address + (AddrT) 2*256*1024*1024;
+    /* Hierarchical controllers: the request waits in its tile/block queue
+     * and only stalls the host when that particular queue is full. Queues
+     * are created the first time their tile/block is addressed. The chip
+     * still has a single admission point (receiveReq), so the queues are
+     * a host-side reorder buffer in front of it: they decide the order in
+     * which requests reach the chip, not how many it accepts per cycle. */
+    int q = ctrlQueueIndex(chip_idx, tile_idx, block_idx);
+    CtrlQueue& queue = _ctrl_queues[q];
+    while ((int)queue.entries.size() >= _ctrl_queue_depth)
+        tot_clks += scheduleCtrl(chip_idx);
+
+    CtrlEntry entry = {req, chip_idx, tile_idx, block_idx, row_idx, _ctrl_seq++, _cur_tenant};
+    if (isBufferOp(req.type))
+        _ctrl_buffer_seqs[chip_idx].push_back(entry.seq);
+    if (queue.entries.empty())
+        _ctrl_active[chip_idx].push_back(&queue);
+    queue.entries.push_back(entry);
+    _ctrl_pending[chip_idx]++;
+    return tot_clks;
+}
 
+int
+System::scheduleCtrl(int chip_idx)
+{
+    /* FR-FCFS over the queue heads of one chip: heads hitting the open row
+     * of their block go first, then the oldest. Each queue issues at most
+     * one request per cycle and keeps its own order, so dependent
+     * operations on the same block are never reordered. Buffer reads and
+     * writes pass data between blocks through the chip's buffers, so
+     * they also stay in program order across queues: a buffer operation
+     * only issues once every older one of its chip has. With tenants,
+     * latency-priority tenants come first and the others by weighted fair
+     * share, the tenant furthest below its share first. */
+    vector<CtrlQueue*>& active = _ctrl_active[chip_idx];
+    vector<CtrlQueue*> order(active.begin(), active.end());
+    std::sort(order.begin(), order.end(), [this](CtrlQueue* a, CtrlQueue* b) {
+        const CtrlEntry& ea = a->entries.front();
+        const CtrlEntry& eb = b->entries.front();
+        if (ea.tenant != eb.tenant) {
+            bool prio_a = ea.tenant >= 0 && _tenants[ea.tenant].priority;
+            bool prio_b = eb.tenant >= 0 && _tenants[eb.tenant].priority;
+            if (prio_a != prio_b)
+                return prio_a;
+            double share_a = ea.tenant >= 0 ? _tenants[ea.tenant].served / _tenants[ea.tenant].weight : 0;
+            double share_b = eb.tenant >= 0 ? _tenants[eb.tenant].served / _tenants[eb.tenant].weight : 0;
+            if (share_a != share_b)
+                return share_a < share_b;
+        }
+        bool hit_a = ea.row >= 0 && a->open_row == ea.row;
+        bool hit_b = eb.row >= 0 && b->open_row == eb.row;
+        if (hit_a != hit_b)
+            return hit_a;
+        return ea.seq < eb.seq;
+    });
+
+    int delay = throttlePower(chip_idx);
+    if (delay > 0)
+        return delay;
+
+    /* The oldest request of the chip, to count the ones passing it */
+    uint64_t oldest = ~0ULL;
+    for (CtrlQueue* queue : order)
+        oldest = std::min(oldest, queue->entries.front().seq);
+    int issued = 0;
+    for (CtrlQueue* queue : order) {
+        CtrlEntry& head = queue->entries.front();
+        deque<uint64_t>& buffer_seqs = _ctrl_buffer_seqs[chip_idx];
+        bool buffer_op = isBufferOp(head.req.type);
+        if (buffer_op && buffer_seqs.front() != head.seq)
+            continue;
+        if (!getChip(chip_idx)->receiveReq(head.req))
+            continue;
+        if (buffer_op)
+            buffer_seqs.pop_front();
+        if (head.row >= 0 && queue->open_row == head.row)
+            _ctrl_row_hits++;
+        if (head.seq == oldest)
+            oldest = ~0ULL;
+        else if (oldest != ~0ULL)
+            _ctrl_ahead++;
+        if (head.tenant >= 0)
+            _tenants[head.tenant].served++;
+        queue->open_row = head.row;
+        queue->entries.pop_front();
+        _ctrl_pending[chip_idx]--;
+        _ctrl_issued++;
+        issued++;
+    }
 
-   	std::vector<Request> requests;
-   	Request *request;
-   	//Loop to traverse A
-   	for (int a_ii = 0; a_ii < A_row;a_ii++){
-//------------------------transmit one A row to the block 0------------------------------------------//
-    	request = new Request(Request::Type::SystemCol2Col);
-    	for (int ii = 0; ii < 1; ii++){// no of blocks used
-    		request->addAddr(data_a_p + (AddrT)(a_ii*2  + ii), 20*32);
-    		request->addAddr(pim_p  + (AddrT) (a_p + ii*2) ,20*32);
-    	}
-    	requests.push_back(*request);
-                 //-----------Shift A ------------//
-    	request = new Request(Request::Type::ColBitwise);
-    	for (int no_bit_byte= 0; no_bit_byte < 32;no_bit_byte++){//i: index of current A row
-    		request->addAddr(pim_p  + (AddrT)(32 + no_bit_byte) ,20);//In real case, we need to define the location of each A col
-    	}
-    	requests.push_back(*request);
-                 //-----------ColMv A to get complete one colum------------//
-    	request = new Request(Request::Type::ColMv);
-    	request->addAddr(pim_p  + (AddrT) (a_p + 2) ,20*32);
-    	request->addAddr(pim_p  + (AddrT) (a_p) ,20*32);
-    	//requests.push_back(*request);
+    size_t n_active = 0;
+    for (size_t i = 0; i < active.size(); i++) {
+        if (!active[i]->entries.empty())
+            active[n_active++] = active[i];
+    }
+    active.resize(n_active);
+
+    if (issued > 0)
+        return 0;
+    _ctrl_stalls++;
+    if (_live && !(_ctrl_stalls & 0xfffff))
+        publishStats();
+    getChip(chip_idx)->tick();
+    return 1;
+}
 
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			//sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
+void
+System::setCtrlQueues(bool enable, int depth)
+{
+    /* Whatever the queues still hold goes to the chips first */
+    for (int i = 0; _hierctrl && i < _nchips; i++)
+        drainCtrl(i);
+    _hierctrl = enable;
+    _ctrl_queue_depth = std::max(1, depth);
+    if (!enable)
+        return;
+    /* Block-level queues unless the config asks for tile-level ones */
+    if (!_tilectrl)
+        _blockctrl = true;
+    _ctrl_active.resize(_nchips);
+    _ctrl_pending.resize(_nchips, 0);
+    _ctrl_buffer_seqs.resize(_nchips);
+}
 
-    	//Loop to traverse B
-    	for (int b_ii = 0; b_ii <B_col;b_ii++){
-//------------------------transmit one B col to the block 0------------------------------------------//
-    		request = new Request(Request::Type::SystemCol2Col);
-    		for (int ii = 0; ii < 2; ii++){// no of blocks used
-    			request->addAddr(data_b_p + (AddrT)(b_ii*2  + ii), 20*32);
-    			request->addAddr(pim_p  + (AddrT) (b_p + ii*2) ,20*32);
-    		}
-    		requests.push_back(*request);
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
-                 //-----------Shift B ------------//
-    		request = new Request(Request::Type::ColBitwise);
-    		for (int no_bit_byte= 0; no_bit_byte < 32;no_bit_byte++){//i: index of current A row
-    			request->addAddr(pim_p  + (AddrT)(3*32 + no_bit_byte) ,20);//In real case, we need to define the location of each A col
-    		}
-    		requests.push_back(*request);
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
-                 //-----------ColMv B to get complete one colum------------//
-    		request = new Request(Request::Type::ColMv);
-    		request->addAddr(pim_p  + (AddrT) (b_p + 2) ,20*32);
-    		request->addAddr(pim_p  + (AddrT) (b_p) ,20*32);
-    		requests.push_back(*request);
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
-//------------------------Calculation------------------------------------------//
-    		//loop to do multiplication
-    		request = new Request(Request::Type::RowMul);
-    		for (int m_i = 0; m_i <height;m_i++){
-    			request->addAddr(pim_p  + (AddrT) (m_i*_ncols) ,2*32); //The results is stored at sum_p
-    		}
-    		requests.push_back(*request);
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
-    		//loop to do addition
-    		for (int add_i = 1; add_i <height;add_i++){
-    			request = new Request(Request::Type::ColAdd);
-    			request->addAddr(pim_p,2*32);//The results will be stored at the end of this col
-    			requests.push_back(*request);
-    		}
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
+int
+System::drainCtrl(int chip_idx)
+{
+    int tot_clks = 0;
+    if (!_hierctrl)
+        return tot_clks;
+    while (_ctrl_pending[chip_idx] > 0)
+        tot_clks += scheduleCtrl(chip_idx);
+    return tot_clks;
+}
 
-    		//send sum back to storage unit
-    		request = new Request(Request::Type::SystemRow2Row);
-    		request->addAddr(pim_p  + (AddrT) (2*height -1 ) ,32);//The results will be stored at the end of this col
-    		request->addAddr(sum_p ,32);//The results will be stored at the end of this col
-    		requests.push_back(*request);
-    		//update sum_p to the next block
-    		sum_p = sum_p + (AddrT)_ncols*_nrows;
-    		//issure request
-    		for (unsigned int i = 0; i < requests.size(); i++){
-    			sendRequest(requests[i]);
-    		}
-    		std::vector<Request>().swap(requests);
+void
+System::reportController()
+{
+    if (!_hierctrl)
+        return;
+    fprintf(rstFile, "\n############# Controller ##########\n");
+    fprintf(rstFile, "Controller queues: %s-level, depth %d\n",
+            _blockctrl ? "block" : "tile", _ctrl_queue_depth);
+    fprintf(rstFile, "Issued requests: %lu\n", _ctrl_issued);
+    fprintf(rstFile, "Open-row hits: %lu\n", _ctrl_row_hits);
+    fprintf(rstFile, "Issued ahead of older requests: %lu\n", _ctrl_ahead);
+    fprintf(rstFile, "Admission stall cycles: %lu\n", _ctrl_stalls);
+}
 
-    	}//loop to traverse B
-    }//loop to traverse A
+void
+System::setPowerCap(double chip_cap, double system_cap, int window)
+{
+    /* Caps are in watts, window is in chip cycles; 0 disables a cap */
+    _power_chip_cap = chip_cap;
+    _power_sys_cap = system_cap;
+    _power_window = window > 0 ? window : 1000;
+    int n = _chips.size();
+    _power_win_start.assign(n, 0);
+    _power_win_energy.assign(n, 0.0);
+    _power_peak.assign(n, 0.0);
+    _power_throttle.assign(n, 0);
+    for (int i = 0; i < n; i++) {
+        _power_win_start[i] = chipTime(i);
+        _power_win_energy[i] = chipEnergy(i);
+    }
+}
 
+void
+System::rollPowerWindow(int chip_idx)
+{
+    TimeT now = chipTime(chip_idx);
+    double energy = chipEnergy(chip_idx);
+    TimeT elapsed = now - _power_win_start[chip_idx];
+    if (elapsed > 0) {
+        /* _clock_rate is in MHz, so nJ per ns is W */
+        double power = (energy - _power_win_energy[chip_idx])
+                       / (elapsed * 1000.0 / _clock_rate);
+        if (power > _power_peak[chip_idx])
+            _power_peak[chip_idx] = power;
+    }
+    _power_win_start[chip_idx] = now;
+    _power_win_energy[chip_idx] = energy;
 }
 
-void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_col) 
+int
+System::throttlePower(int chip_idx)
 {
-    AddrT storage_start_address =  (AddrT)_ncols *_nrows * _nblocks * _ntiles / 4 * 3; // use the last 3/4 for storage units
-    AddrT pim_start_address = 0;
+    if ((_power_chip_cap <= 0 && _power_sys_cap <= 0) 
+            || chip_idx >= (int)_power_win_start.size())
+        return 0;
+
+    int delay = 0;
+    double window_ns = _power_window * 1000.0 / _clock_rate;
+    MemoryChip* chip = getChip(chip_idx);
+    while (true) {
+        TimeT now = chip->getTime();
+        if (now >= _power_win_start[chip_idx] + _power_window)
+            rollPowerWindow(chip_idx);
+
+        double used = chip->getTotalEnergy() - _power_win_energy[chip_idx];
+        bool over = _power_chip_cap > 0 && used >= _power_chip_cap * window_ns;
+        if (!over && _power_sys_cap > 0) {
+            /* Only windows still open at this chip's time count towards the
+             * system budget, so a lagging chip cannot block others forever */
+            double sys_used = 0;
+            for (size_t i = 0; i < _power_win_start.size(); i++) {
+                if (_chips[i] && _power_win_start[i] + _power_window > now)
+                    sys_used += _chips[i]->getTotalEnergy() - _power_win_energy[i];
+            }
+            over = sys_used >= _power_sys_cap * window_ns;
+        }
+        if (!over)
+            break;
+        chip->tick();
+        delay++;
+        _power_throttle[chip_idx]++;
+    }
+    return delay;
+}
 
-    //The data will be arranged in block in this way
-    //[0]-----[1]-----[2:11]-----[12:21]-----[22:31]
-    //MUL1---MUL2-------A-----------B----------PS---
+void
+System::reportPower()
+{
+    if (_power_chip_cap <= 0 && _power_sys_cap <= 0)
+        return;
+    fprintf(rstFile, "\n############# Power ###############\n");
+    fprintf(rstFile, "Power cap: %.3lf W per chip, %.3lf W system, %d cycle window\n",
+            _power_chip_cap, _power_sys_cap, _power_window);
+    TimeT makespan = 0;
+    double tot_energy = 0;
+    for (size_t i = 0; i < _power_win_start.size(); i++) {
+        rollPowerWindow(i);
+        TimeT t = chipTime(i);
+        double e = chipEnergy(i);
+        double avg = t > 0 ? e / (t * 1000.0 / _clock_rate) : 0;
+        fprintf(rstFile, "Chip#%lu: avg %.4lf W, peak %.4lf W, throttled %lu clocks\n",
+                i, avg, _power_peak[i], _power_throttle[i]);
+        if (t > makespan)
+            makespan = t;
+        tot_energy += e;
+    }
+    double seconds = makespan * 1e-6 / _clock_rate;
+    if (seconds > 0 && tot_energy > 0) {
+        fprintf(rstFile, "Average system power: %.4lf W\n", tot_energy * 1e-9 / seconds);
+        fprintf(rstFile, "Throughput under cap: %.4e requests/s\n", tot_reqs / seconds);
+        fprintf(rstFile, "Efficiency: %.4e requests/J\n", tot_reqs / (tot_energy * 1e-9));
+    }
+}
 
-    int mul1_p = 0;
-    int mul2_p = 1;
-    int a_width = 1;     // Number of row in block which are occupied by A
-    int b_width = 1;     // Number of row in block which are occupied by B
-    int height = 40;     // Number of row in block which are occupied by B
-    int a_p    = 0;
-    int b_p    = mul2_p;
-    int ps_p   = b_p + 1;
-    int block_row = 32; // Number of data can be stored in one row of block
-    int block_col = 1024; // Number of data can be stored in one col of block
-    int no_block = A_col/a_width * B_col/b_width * (A_col/height);
-    int no_block_same_a = B_col/b_width* (A_col/height);
-    int no_block_same_b = A_row/a_width;
-    int a_sb_y = ceil((float)A_row/(float)a_width );
-    int b_sb_x = ceil((float)B_col/(float) b_width);
-    int last_sum_p = height;
+System::System(Config* config, const DesignPoint& point)
+    : _config(config)
+{
+    /* Geometry, network and result file come from the design point,
+     * everything else from the shared config */
+    _nchips = point.nchips;
+    _ntiles = point.ntiles;
+    _nblocks = point.nblocks;
+    _nrows = point.nrows;
+    _ncols = point.ncols;
+    _netscheme = point.netscheme;
+    _rstname = point.rstfile;
+    init();
+}
 
+void
+System::init()
+{
+    _clock_rate = _config->get_clock_rate();
+    _blockctrl = _config->get_blockctrl();
+    _tilectrl = _config->get_tilectrl();
+    _chipctrl = _config->get_chipctrl();
+    _force_sync = _config->getSync();
+    /* Per-tile/per-block queues are only used when the config asks for
+     * them explicitly; a chip controller keeps the single admission point. */
+    _hierctrl = (_blockctrl || _tilectrl) && !_chipctrl;
+    if (!(_blockctrl || _tilectrl || _chipctrl))
+        _blockctrl = true;
+    _blocksize = _nrows * _ncols; // set the banksize based on columns and rows
+    rstFile = fopen(_rstname.c_str(), "w");
 
-    AddrT data_a_p = 0;
-    AddrT data_b_p = 0;
-    AddrT pim_a_p = 0;
-    AddrT pim_b_p = 0;
-    AddrT sum_p = 4000*_ncols*_nrows; //TODO
+    _values = new MemoryCharacteristics();
+    /* Chips are built on first access (see getChip), untouched chips only
+     * keep the time they would have been synchronized to. Chip clocks are
+     * mirrored in one contiguous array and chip sets are bitmasks, so a
+     * global sync is a reduction over the array. */
+    _chips.assign(_nchips, NULL);
+    _chip_clock.assign(_nchips, 0);
+    _idle_energy.assign(_nchips, 0.0);
+    _all_chips.assign((_nchips + 63) / 64, 0);
+    for (int i = 0; i < _nchips; i++)
+        _all_chips[i / 64] |= 1ULL << (i % 64);
+    _busy_chips.assign(_all_chips.size(), 0);
+    /* Hierarchical controller queues */
+    _ctrl_queue_depth = 8;
+    _ctrl_seq = 0;
+    _ctrl_issued = 0;
+    _ctrl_row_hits = 0;
+    _ctrl_ahead = 0;
+    _ctrl_stalls = 0;
+    _host_stalls = 0;
+    /* Power manager, disabled until setPowerCap() is called */
+    _power_chip_cap = 0;
+    _power_sys_cap = 0;
+    _power_window = 1000;
+    if (_hierctrl) {
+        _ctrl_active.resize(_nchips);
+        _ctrl_pending.assign(_nchips, 0);
+        _ctrl_buffer_seqs.resize(_nchips);
+    }
+    /* Network statistics kept on the system side */
+    _net_reqs = 0;
+    _net_bytes = 0;
+    _net_clks = 0;
+    _prefetch = false;
+    _prefetch_reqs = 0;
+    _kernel_rounds = 0;
+    _kernel_reqs = 0;
+    /* Transfer compression, off until setCompression() */
+    _compress = Compression::None;
+    _compress_rate = 64;
+    _compress_raw = 0;
+    _compress_wire = 0;
+    _compress_xfers = 0;
+    _compress_used = 0;
+    _compress_enc = 0;
+    _compress_dec = 0;
+    /* Live statistics, not exported until setLiveStats() */
+    _live = NULL;
+    _live_size = 0;
+    _live_interval = 1024;
+    _live_last = 0;
+    _live_target = 0;
+    _live_goal = 0;
+    /* No tenants: the whole system belongs to one untagged workload */
+    _cur_tenant = -1;
+    /* Operand precision, 32-bit integers unless a kernel asks otherwise */
+    _precision = Precision::Int32;
+    /* Functional mode, off by default */
+    _functional = false;
+    _func_words = (_nrows + 63) / 64;
+    /* Per-block utilization, one counter array per chip sized when the chip
+     * is built (see newChip); migration is off until setMigration() */
+    _block_ops.assign(_nchips, vector<uint64_t>());
+    _block_window.assign(_nchips, vector<uint64_t>());
+    _window_ops = 0;
+    _migrate = false;
+    _migrating = false;
+    _migrate_threshold = 2.0;
+    _migrate_interval = 4096;
+    _migrations = 0;
+    _migrate_clks = 0;
+    _spread_before = -1;
+    _spread_last = -1;
+    /* Analytic estimator, uncalibrated until calibrateEstimator() */
+    _estimating = false;
+    _est_energy = 0;
+    _est_cycles_error = -1;
+    _est_energy_error = -1;
+    _probe = NULL;
+    /* Network connection. Torus, fat-tree and hierarchical networks are
+     * modeled on the system side with precomputed tables (buildNetTable),
+     * the GlobalConnection then only keeps the statistics. */
+    GlobalConnection::Type nt;
+    if (_netscheme == "mesh") {
+        nt = GlobalConnection::Type::Mesh;
+    } else if (_netscheme == "dragonfly") {
+        nt = GlobalConnection::Type::Dragonfly;
+    } else {
+        nt = GlobalConnection::Type::Ideal;
+    }
+    _conn = new GlobalConnection(this, nt); 
+    buildNetTable();
+}
 
+vector<System::DesignPoint>
+System::parseSweep(Config* config, const string& spec)
+{
+    /* spec is a list of "key=v1,v2,..." fields separated by whitespace,
+     * e.g. "nchips=1,4 nblocks=64,256 netscheme=mesh,dragonfly".
+     * Keys that are not given keep the value from the config. */
+    vector<vector<int>> geo = {{config->get_nchips()}, {config->get_ntiles()},
+                               {config->get_nblocks()}, {config->get_nrows()},
+                               {config->get_ncols()}};
+    const char* keys[] = {"nchips", "ntiles", "nblocks", "nrows", "ncols"};
+    vector<string> nets = {config->get_netscheme()};
+
+    istringstream fields(spec);
+    string field;
+    while (fields >> field) {
+        size_t eq = field.find('=');
+        if (eq == string::npos) {
+            cout << "[Error] bad sweep field: " << field << endl;
+            continue;
+        }
+        string key = field.substr(0, eq);
+        vector<string> vals;
+        istringstream list(field.substr(eq + 1));
+        string v;
+        while (getline(list, v, ','))
+            vals.push_back(v);
+
+        if (key == "netscheme") {
+            nets = vals;
+            continue;
+        }
+        int k = 0;
+        while (k < 5 && key != keys[k])
+            k++;
+        if (k == 5) {
+            cout << "[Error] unknown sweep key: " << key << endl;
+            continue;
+        }
+        geo[k].clear();
+        for (const string& val : vals)
+            geo[k].push_back(atoi(val.c_str()));
+    }
 
-    data_a_p = storage_start_address;
+    vector<DesignPoint> points;
+    for (int nc : geo[0])
+    for (int nt : geo[1])
+    for (int nb : geo[2])
+    for (int nr : geo[3])
+    for (int ncol : geo[4])
+    for (const string& net : nets) {
+        DesignPoint p;
+        p.nchips = nc;
+        p.ntiles = nt;
+        p.nblocks = nb;
+        p.nrows = nr;
+        p.ncols = ncol;
+        p.netscheme = net;
+        p.rstfile = config->get_rstfile() + ".dse" + to_string(points.size());
+        points.push_back(p);
+    }
+    return points;
+}
+
+vector<System::DesignResult>
+System::exploreDesignSpace(Config* config, const vector<DesignPoint>& points,
+                           const vector<Request>& trace, int n_threads, FILE* out,
+                           bool analytic)
+{
+    vector<DesignResult> results(points.size());
+    atomic<size_t> next(0);
+
+    /* Every worker builds its own System; the trace is only read. It is
+     * compiled against each design point first, so a point whose geometry
+     * cannot hold the trace's addresses is reported as failed instead of
+     * stopping the whole sweep. */
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next++) < points.size()) {
+            System sys(config, points[i]);
+            DesignResult& res = results[i];
+            res.point = points[i];
+            res.cycles = 0;
+            res.energy = 0;
+            res.error = 0;
+            res.net_reqs = res.net_bytes = res.net_clks = 0;
+            Program prog;
+            res.ok = sys.compile(trace, prog);
+            if (!res.ok)
+                continue;
+            if (analytic) {
+                /* The leaf models are fitted on microbenchmarks only. The
+                 * error bound is then checked on up to 64 trace requests
+                 * sampled evenly across the trace, so it is measured on
+                 * requests calibration never saw and not only on the
+                 * warm-up at its head */
+                size_t step = std::max<size_t>(1, (trace.size() + 63) / 64);
+                vector<Request> validation;
+                for (size_t k = step / 2; k < trace.size(); k += step)
+                    validation.push_back(trace[k]);
+                sys.calibrateEstimator(validation);
+                Estimate est = sys.estimate(trace);
+                res.cycles = (TimeT)est.cycles;
+                res.energy = est.energy;
+                res.error = std::max(est.cycles_error, est.energy_error);
+                continue;
+            }
+            sys.runProgram(prog);
+            sys.finish();
+
+            for (int c = 0; c < (int)sys._chips.size(); c++) {
+                if (sys.chipTime(c) > res.cycles)
+                    res.cycles = sys.chipTime(c);
+                res.energy += sys.chipEnergy(c);
+            }
+            res.net_reqs = sys._net_reqs;
+            res.net_bytes = sys._net_bytes;
+            res.net_clks = sys._net_clks;
+        }
+    };
+
+    if (n_threads < 1)
+        n_threads = 1;
+    vector<thread> pool;
+    for (int t = 1; t < n_threads; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (thread& t : pool)
+        t.join();
+
+    /* Pareto front over (cycles, energy) of the points that ran */
+    for (size_t i = 0; i < results.size(); i++) {
+        results[i].pareto = results[i].ok;
+        for (size_t j = 0; j < results.size() && results[i].pareto; j++) {
+            if (j == i || !results[j].ok)
+                continue;
+            bool no_worse = results[j].cycles <= results[i].cycles 
+                         && results[j].energy <= results[i].energy;
+            bool better = results[j].cycles < results[i].cycles 
+                       || results[j].energy < results[i].energy;
+            if (no_worse && better)
+                results[i].pareto = false;
+        }
+    }
+
+    if (out && analytic) {
+        fprintf(out, "%6s %6s %7s %6s %6s %10s %14s %14s %8s %6s\n",
+                "chips", "tiles", "blocks", "rows", "cols", "network",
+                "cycles", "energy(nJ)", "error", "pareto");
+        for (const DesignResult& r : results) {
+            if (!r.ok) {
+                fprintf(out, "%6d %6d %7d %6d %6d %10s %14s\n",
+                        r.point.nchips, r.point.ntiles, r.point.nblocks, r.point.nrows,
+                        r.point.ncols, r.point.netscheme.c_str(), "failed");
+                continue;
+            }
+            fprintf(out, "%6d %6d %7d %6d %6d %10s %14lu %14.4lf %7.2lf%% %6s\n",
+                    r.point.nchips, r.point.ntiles, r.point.nblocks, r.point.nrows,
+                    r.point.ncols, r.point.netscheme.c_str(), r.cycles, r.energy,
+                    r.error * 100, r.pareto ? "*" : "");
+        }
+    } else if (out) {
+        fprintf(out, "%6s %6s %7s %6s %6s %10s %14s %14s %10s %12s %10s %6s\n",
+                "chips", "tiles", "blocks", "rows", "cols", "network",
+                "cycles", "energy(nJ)", "net_reqs", "net_bytes", "net_clks", "pareto");
+        for (const DesignResult& r : results) {
+            if (!r.ok) {
+                fprintf(out, "%6d %6d %7d %6d %6d %10s %14s\n",
+                        r.point.nchips, r.point.ntiles, r.point.nblocks, r.point.nrows,
+                        r.point.ncols, r.point.netscheme.c_str(), "failed");
+                continue;
+            }
+            fprintf(out, "%6d %6d %7d %6d %6d %10s %14lu %14.4lf %10lu %12lu %10lu %6s\n",
+                    r.point.nchips, r.point.ntiles, r.point.nblocks, r.point.nrows,
+                    r.point.ncols, r.point.netscheme.c_str(), r.cycles, r.energy,
+                    r.net_reqs, r.net_bytes, r.net_clks, r.pareto ? "*" : "");
+        }
+    }
+    return results;
+}
+
+MemoryChip*
+System::newChip(int chip_idx)
+{
+    MemoryChip* chip = new MemoryChip(_ntiles, _nblocks, _nrows, _ncols, _clock_rate);
+    Controller* ctrl = new Controller(chip);
+    chip->setId(chip_idx);
+    chip->setController(ctrl, _clock_rate);
+    chip->setParent(NULL);
+    chip->setValues(_values);
+    if ((size_t)chip_idx < _block_ops.size() && _block_ops[chip_idx].empty()) {
+        _block_ops[chip_idx].assign((size_t)_ntiles * _nblocks, 0);
+        _block_window[chip_idx].assign((size_t)_ntiles * _nblocks, 0);
+    }
+    return chip;
+}
+
+MemoryChip*
+System::getChip(int chip_idx)
+{
+    MemoryChip* chip = _chips[chip_idx];
+    if (chip)
+        return chip;
+    /* First touch: catch the new chip up with the time it has been
+     * idling at, so it joins the simulation in step with the others */
+    chip = newChip(chip_idx);
+    while (chip->getTime() < _chip_clock[chip_idx])
+        chip->tick();
+    chip->updateTime();
+    _chips[chip_idx] = chip;
+    return chip;
+}
+
+int
+System::advanceChip(int chip_idx, TimeT time)
+{
+    /* Runs one chip's clock forward to time, returns the cycles ticked.
+     * All clock catch-up goes through here, so a chip that can skip idle
+     * cycles only needs this loop replaced. */
+    MemoryChip* chip = getChip(chip_idx);
+    int ticks = 0;
+    while (chip->getTime() < time) {
+        chip->tick();
+        ticks++;
+    }
+    _chip_clock[chip_idx] = chip->getTime();
+    return ticks;
+}
+
+TimeT
+System::chipTime(int chip_idx)
+{
+    if (_chips[chip_idx])
+        return _chips[chip_idx]->getTime();
+    return _chip_clock[chip_idx];
+}
+
+double
+System::chipEnergy(int chip_idx)
+{
+    if (_chips[chip_idx])
+        return _chips[chip_idx]->getTotalEnergy();
+    return _idle_energy[chip_idx];
+}
+
+void
+System::reportChips()
+{
+    /* Untouched chips all idled identically, so one stand-in chip ticked
+     * to their time provides their stats and idle energy */
+    MemoryChip* idle = NULL;
+    for (int i = 0; i < _nchips; i++) {
+        if (_chips[i]) {
+            while (!_chips[i]->isFinished())
+                _chips[i]->tick();
+            _chips[i]->outputStats(rstFile);
+            continue;
+        }
+        if (idle && idle->getTime() > _chip_clock[i]) {
+            delete idle;
+            idle = NULL;
+        }
+        if (!idle)
+            idle = newChip(i);
+        while (idle->getTime() < _chip_clock[i])
+            idle->tick();
+        idle->setId(i);
+        idle->outputStats(rstFile);
+        _idle_energy[i] = idle->getTotalEnergy();
+    }
+    if (idle)
+        delete idle;
+}
+
+/* Functional mode
+ *
+ * Each block is stored as bit planes, one per column, holding that column's
+ * bit for every row. A row operation issued on many rows of a block with the
+ * same columns is therefore evaluated bit-sliced: bit j of every operand is
+ * one plane, and a w-bit add is w full-adder steps over whole planes. Values
+ * are unsigned and stored LSB first, along the row for Row* operations and
+ * down the column for Col* operations. A w-bit binary operation reads A and B
+ * from two adjacent w-bit fields and writes the result into the next field.
+ */
+namespace {
+
+inline void
+planeFullAdd(const uint64_t* a, const uint64_t* b, uint64_t* carry, uint64_t* sum, int nwords)
+{
+    int w = 0;
+#if defined(__AVX512F__)
+    for (; w + 8 <= nwords; w += 8) {
+        __m512i va = _mm512_loadu_si512(a + w);
+        __m512i vb = _mm512_loadu_si512(b + w);
+        __m512i vc = _mm512_loadu_si512(carry + w);
+        _mm512_storeu_si512(sum + w, _mm512_ternarylogic_epi64(va, vb, vc, 0x96));
+        _mm512_storeu_si512(carry + w, _mm512_ternarylogic_epi64(va, vb, vc, 0xE8));
+    }
+#elif defined(__AVX2__)
+    for (; w + 4 <= nwords; w += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i*)(a + w));
+        __m256i vb = _mm256_loadu_si256((const __m256i*)(b + w));
+        __m256i vc = _mm256_loadu_si256((const __m256i*)(carry + w));
+        __m256i vx = _mm256_xor_si256(va, vb);
+        _mm256_storeu_si256((__m256i*)(sum + w), _mm256_xor_si256(vx, vc));
+        _mm256_storeu_si256((__m256i*)(carry + w),
+                _mm256_or_si256(_mm256_and_si256(va, vb), _mm256_and_si256(vc, vx)));
+    }
+#endif
+    for (; w < nwords; w++) {
+        uint64_t va = a[w], vb = b[w], vc = carry[w];
+        sum[w] = va ^ vb ^ vc;
+        carry[w] = (va & vb) | (vc & (va ^ vb));
+    }
+}
+
+inline void
+planeFill(uint64_t* dst, uint64_t val, int nwords)
+{
+    for (int w = 0; w < nwords; w++)
+        dst[w] = val;
+}
+
+/* dst = cond ? x : dst, per bit */
+inline void
+planeSelect(uint64_t* dst, const uint64_t* x, const uint64_t* cond, int nwords)
+{
+    for (int w = 0; w < nwords; w++)
+        dst[w] = (dst[w] & ~cond[w]) | (x[w] & cond[w]);
+}
+
+/* a + (invert ? ~b : b) + carry over width planes, the final carry is left
+ * in carry */
+void
+slicedAdd(const uint64_t* a, const uint64_t* b, uint64_t* out, uint64_t* carry,
+          int width, int nwords, bool invert)
+{
+    vector<uint64_t> nb(nwords);
+    for (int j = 0; j < width; j++) {
+        const uint64_t* bj = b + (size_t)j * nwords;
+        if (invert) {
+            for (int w = 0; w < nwords; w++)
+                nb[w] = ~bj[w];
+            bj = nb.data();
+        }
+        planeFullAdd(a + (size_t)j * nwords, bj, carry, out + (size_t)j * nwords, nwords);
+    }
+}
+
+void
+slicedMul(const uint64_t* a, const uint64_t* b, uint64_t* out, int width, int nwords)
+{
+    vector<uint64_t> part(nwords), carry(nwords);
+    planeFill(out, 0, width * nwords);
+    for (int i = 0; i < width; i++) {
+        const uint64_t* bi = b + (size_t)i * nwords;
+        planeFill(carry.data(), 0, nwords);
+        for (int j = i; j < width; j++) {
+            const uint64_t* aj = a + (size_t)(j - i) * nwords;
+            for (int w = 0; w < nwords; w++)
+                part[w] = aj[w] & bi[w];
+            uint64_t* oj = out + (size_t)j * nwords;
+            planeFullAdd(oj, part.data(), carry.data(), oj, nwords);
+        }
+    }
+}
+
+/* Restoring division, division by zero yields all ones */
+void
+slicedDiv(const uint64_t* a, const uint64_t* b, uint64_t* out, int width, int nwords)
+{
+    int rw = width + 1;
+    vector<uint64_t> rem((size_t)rw * nwords, 0), diff((size_t)rw * nwords),
+                     bext((size_t)rw * nwords, 0), carry(nwords);
+    std::copy(b, b + (size_t)width * nwords, bext.begin());
+    for (int i = width - 1; i >= 0; i--) {
+        std::copy_backward(rem.begin(), rem.end() - nwords, rem.end());
+        std::copy(a + (size_t)i * nwords, a + (size_t)(i + 1) * nwords, rem.begin());
+        planeFill(carry.data(), ~0ULL, nwords);
+        slicedAdd(rem.data(), bext.data(), diff.data(), carry.data(), rw, nwords, true);
+        /* carry out set means rem >= b */
+        std::copy(carry.begin(), carry.end(), out + (size_t)i * nwords);
+        for (int j = 0; j < rw; j++)
+            planeSelect(rem.data() + (size_t)j * nwords, diff.data() + (size_t)j * nwords,
+                        carry.data(), nwords);
+    }
+}
+
+/* Scalar version of the same semantics, used along columns */
+uint64_t
+scalarOp(Request::Type type, uint64_t a, uint64_t b, uint64_t mask)
+{
+    switch (type) {
+        case Request::Type::ColAdd: return (a + b) & mask;
+        case Request::Type::ColSub: return (a - b) & mask;
+        case Request::Type::ColMul: return (a * b) & mask;
+        case Request::Type::ColDiv: return b ? a / b : mask;
+        default: return 0;
+    }
+}
+
+}
+
+void
+System::setFunctional(bool enable)
+{
+    _functional = enable;
+    _func_words = (_nrows + 63) / 64;
+    if (!enable)
+        _func_blocks.clear();
+}
+
+uint64_t*
+System::funcPlane(int chip, int tile, int block, int col)
+{
+    uint64_t key = ((uint64_t)chip * _ntiles + tile) * _nblocks + block;
+    vector<uint64_t>& planes = _func_blocks[key];
+    if (planes.empty())
+        planes.assign((size_t)_ncols * _func_words, 0);
+    return planes.data() + (size_t)col * _func_words;
+}
+
+void
+System::funcRead(AddrT addr, bool along_row, int size, vector<uint8_t>& bits)
+{
+    /* The block is looked up once; along a row every bit is in the next
+     * column plane, along a column all bits are in the same plane */
+    int chip, tile, block, row, col;
+    getLocation(addr, chip, tile, block, row, col);
+    bits.assign(size, 0);
+    const uint64_t* planes = funcPlane(chip, tile, block, 0);
+    int nw = _func_words;
+    if (along_row) {
+        int n = std::min(size, _ncols - col);
+        const uint64_t* word = planes + (size_t)col * nw + (row >> 6);
+        for (int i = 0; i < n; i++, word += nw)
+            bits[i] = (*word >> (row & 63)) & 1;
+    } else {
+        int n = std::min(size, _nrows - row);
+        const uint64_t* plane = planes + (size_t)col * nw;
+        for (int i = 0; i < n; i++) {
+            int r = row + i;
+            bits[i] = (plane[r >> 6] >> (r & 63)) & 1;
+        }
+    }
+}
+
+void
+System::funcWrite(AddrT addr, bool along_row, const vector<uint8_t>& bits)
+{
+    int chip, tile, block, row, col;
+    getLocation(addr, chip, tile, block, row, col);
+    uint64_t* planes = funcPlane(chip, tile, block, 0);
+    int nw = _func_words;
+    int size = bits.size();
+    if (along_row) {
+        int n = std::min(size, _ncols - col);
+        uint64_t* word = planes + (size_t)col * nw + (row >> 6);
+        uint64_t bit = 1ULL << (row & 63);
+        for (int i = 0; i < n; i++, word += nw)
+            *word = bits[i] ? *word | bit : *word & ~bit;
+    } else {
+        int n = std::min(size, _nrows - row);
+        uint64_t* plane = planes + (size_t)col * nw;
+        for (int i = 0; i < n; i++) {
+            int r = row + i;
+            uint64_t bit = 1ULL << (r & 63);
+            plane[r >> 6] = bits[i] ? plane[r >> 6] | bit : plane[r >> 6] & ~bit;
+        }
+    }
+}
+
+void
+System::writeValue(AddrT addr, uint64_t value, int width, bool along_row)
+{
+    vector<uint8_t> bits(width);
+    for (int i = 0; i < width; i++)
+        bits[i] = i < 64 ? (value >> i) & 1 : 0;
+    funcWrite(addr, along_row, bits);
+}
+
+uint64_t
+System::readValue(AddrT addr, int width, bool along_row)
+{
+    vector<uint8_t> bits;
+    funcRead(addr, along_row, width, bits);
+    uint64_t value = 0;
+    for (int i = 0; i < width && i < 64; i++)
+        value |= (uint64_t)bits[i] << i;
+    return value;
+}
+
+void
+System::funcMove(AddrT src, bool src_row, AddrT dst, bool dst_row, int size)
+{
+    vector<uint8_t> bits;
+    funcRead(src, src_row, size, bits);
+    funcWrite(dst, dst_row, bits);
+}
+
+void
+System::funcRowOp(Request& req)
+{
+    /* Group the rows that share a block and column range, each group is
+     * one bit-sliced kernel call with a row mask */
+    map<tuple<int, int, int, int, int>, vector<uint64_t>> groups;
+    for (size_t i = 0; i < req.addr_list.size(); i++) {
+        int chip, tile, block, row, col;
+        getLocation(req.addr_list[i], chip, tile, block, row, col);
+        vector<uint64_t>& mask = groups[make_tuple(chip, tile, block, col, req.size_list[i])];
+        if (mask.empty())
+            mask.assign(_func_words, 0);
+        mask[row >> 6] |= 1ULL << (row & 63);
+    }
+
+    int nw = _func_words;
+    for (auto& g : groups) {
+        int chip = get<0>(g.first), tile = get<1>(g.first), block = get<2>(g.first),
+            col = get<3>(g.first), size = get<4>(g.first);
+        const vector<uint64_t>& mask = g.second;
+        bool binary = req.type != Request::Type::RowBitwise;
+        int width = binary ? size / 2 : size;
+        if (width <= 0 || col + width > _ncols)
+            continue;
+
+        /* Operand planes, gathered so fields running off the block read 0 */
+        vector<uint64_t> a((size_t)width * nw, 0), b((size_t)width * nw, 0),
+                         out((size_t)width * nw, 0);
+        for (int j = 0; j < width; j++) {
+            const uint64_t* pa = funcPlane(chip, tile, block, col + j);
+            std::copy(pa, pa + nw, a.begin() + (size_t)j * nw);
+            if (binary && col + width + j < _ncols) {
+                const uint64_t* pb = funcPlane(chip, tile, block, col + width + j);
+                std::copy(pb, pb + nw, b.begin() + (size_t)j * nw);
+            }
+        }
+
+        int dst_col = col + (binary ? 2 * width : width);
+        int n_out = width;
+        vector<uint64_t> carry(nw, 0);
+        switch (req.type) {
+            case Request::Type::RowAdd:
+                slicedAdd(a.data(), b.data(), out.data(), carry.data(), width, nw, false);
+                break;
+            case Request::Type::RowSub:
+                planeFill(carry.data(), ~0ULL, nw);
+                slicedAdd(a.data(), b.data(), out.data(), carry.data(), width, nw, true);
+                break;
+            case Request::Type::RowMul:
+                slicedMul(a.data(), b.data(), out.data(), width, nw);
+                break;
+            case Request::Type::RowDiv:
+                slicedDiv(a.data(), b.data(), out.data(), width, nw);
+                break;
+            case Request::Type::RowBitwise: {
+                /* Shift the field up by its own width, clearing the source */
+                out = a;
+                vector<uint64_t> zero(nw, 0);
+                for (int j = 0; j < width; j++)
+                    planeSelect(funcPlane(chip, tile, block, col + j), zero.data(),
+                                mask.data(), nw);
+                break;
+            }
+            case Request::Type::RowSearch: {
+                /* One match bit per row: A == B */
+                vector<uint64_t> diff(nw, 0);
+                for (int j = 0; j < width; j++)
+                    for (int w = 0; w < nw; w++)
+                        diff[w] |= a[(size_t)j * nw + w] ^ b[(size_t)j * nw + w];
+                for (int w = 0; w < nw; w++)
+                    out[w] = ~diff[w];
+                n_out = 1;
+                break;
+            }
+            default:
+                break;
+        }
+        for (int j = 0; j < n_out && dst_col + j < _ncols; j++)
+            planeSelect(funcPlane(chip, tile, block, dst_col + j),
+                        out.data() + (size_t)j * nw, mask.data(), nw);
+    }
+}
+
+void
+System::funcColOp(Request& req)
+{
+    /* Same stride as sendColPIM, so the functional and timing models see
+     * the same operations */
+    for (size_t i = 0; i < req.addr_list.size(); i += 2) {
+        AddrT addr = req.addr_list[i];
+        int size = req.size_list[i];
+        int chip, tile, block, row, col;
+        getLocation(addr, chip, tile, block, row, col);
+        bool binary = req.type != Request::Type::ColBitwise;
+        int width = binary ? size / 2 : size;
+        if (width <= 0 || width > 64 || row + width > _nrows)
+            continue;
+        uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+        AddrT next = addr + (AddrT)width * _ncols;
+
+        uint64_t a = readValue(addr, width, false);
+        if (req.type == Request::Type::ColBitwise) {
+            writeValue(addr, 0, width, false);
+            writeValue(next, a, width, false);
+            continue;
+        }
+        uint64_t b = readValue(next, width, false);
+        AddrT dst = addr + (AddrT)2 * width * _ncols;
+        if (req.type == Request::Type::ColSearch)
+            writeValue(dst, a == b, 1, false);
+        else
+            writeValue(dst, scalarOp(req.type, a, b, mask), width, false);
+    }
+}
+
+void
+System::funcExec(Request& req)
+{
+    size_t n_ops = req.addr_list.size();
+    switch (req.type) {
+        case Request::Type::RowMv:
+        case Request::Type::ColMv:
+            for (size_t i = 0; i + 1 < n_ops; i += 2) {
+                bool row = req.type == Request::Type::RowMv;
+                funcMove(req.addr_list[i], row, req.addr_list[i+1], row, req.size_list[i]);
+            }
+            break;
+        case Request::Type::RowAdd:
+        case Request::Type::RowSub:
+        case Request::Type::RowMul:
+        case Request::Type::RowDiv:
+        case Request::Type::RowBitwise:
+        case Request::Type::RowSearch:
+            funcRowOp(req);
+            break;
+        case Request::Type::ColAdd:
+        case Request::Type::ColSub:
+        case Request::Type::ColMul:
+        case Request::Type::ColDiv:
+        case Request::Type::ColBitwise:
+        case Request::Type::ColSearch:
+            funcColOp(req);
+            break;
+        case Request::Type::RowBufferRead:
+        case Request::Type::ColBufferRead: {
+            /* Every address is read, in order, into one buffer */
+            bool row = req.type == Request::Type::RowBufferRead;
+            vector<uint8_t> bits;
+            _func_buffer.clear();
+            for (size_t i = 0; i < n_ops; i++) {
+                funcRead(req.addr_list[i], row, req.size_list[i], bits);
+                _func_buffer.insert(_func_buffer.end(), bits.begin(), bits.end());
+            }
+            break;
+        }
+        case Request::Type::RowBufferWrite:
+        case Request::Type::ColBufferWrite: {
+            /* ... and written back out in the same order */
+            bool row = req.type == Request::Type::RowBufferWrite;
+            size_t pos = 0;
+            for (size_t i = 0; i < n_ops; i++) {
+                vector<uint8_t> bits(req.size_list[i], 0);
+                for (size_t k = 0; k < bits.size() && pos + k < _func_buffer.size(); k++)
+                    bits[k] = _func_buffer[pos + k];
+                pos += bits.size();
+                funcWrite(req.addr_list[i], row, bits);
+            }
+            break;
+        }
+        case Request::Type::SystemRow2Row:
+        case Request::Type::SystemRow2Col:
+        case Request::Type::SystemCol2Row:
+        case Request::Type::SystemCol2Col: {
+            bool src_row = req.type == Request::Type::SystemRow2Row 
+                        || req.type == Request::Type::SystemRow2Col;
+            bool dst_row = req.type == Request::Type::SystemRow2Row 
+                        || req.type == Request::Type::SystemCol2Row;
+            for (size_t i = 0; i + 1 < n_ops; i += 2)
+                funcMove(req.addr_list[i], src_row, req.addr_list[i+1], dst_row,
+                         std::min(req.size_list[i], req.size_list[i+1]));
+            break;
+        }
+        default:
+            /* Host reads/writes and network hops carry no data here */
+            break;
+    }
+}
+
+namespace {
+
+int
+precisionBits(System::Precision p)
+{
+    switch (p) {
+        case System::Precision::Int4:  return 4;
+        case System::Precision::Int8:  return 8;
+        case System::Precision::Int16: return 16;
+        case System::Precision::BF16:  return 16;
+        default:                       return 32;
+    }
+}
+
+/* Mantissa (with hidden bit) and exponent widths, 0 for integers */
+int
+precisionMantissa(System::Precision p)
+{
+    if (p == System::Precision::BF16)
+        return 8;
+    if (p == System::Precision::FP32)
+        return 24;
+    return 0;
+}
+
+int
+precisionExponent(System::Precision p)
+{
+    return precisionMantissa(p) ? 8 : 0;
+}
+
+}
+
+void
+System::setPrecision(Precision p)
+{
+    _precision = p;
+}
+
+void
+System::precisionOps(Request::Type type, int size, vector<pair<Request::Type, int>>& ops)
+{
+    /* Integer operands are costed by the chip directly from their width.
+     * A floating-point operation is split into the bit-serial steps it is
+     * made of: exponent handling, the mantissa operation and the
+     * normalization shift. */
+    ops.clear();
+    int bits = precisionBits(_precision),
+        mant = precisionMantissa(_precision),
+        exp  = precisionExponent(_precision);
+    bool row = type == Request::Type::RowAdd || type == Request::Type::RowSub 
+            || type == Request::Type::RowMul || type == Request::Type::RowDiv;
+    bool col = type == Request::Type::ColAdd || type == Request::Type::ColSub 
+            || type == Request::Type::ColMul || type == Request::Type::ColDiv;
+    if (mant == 0 || !(row || col)) {
+        ops.push_back(make_pair(type, size));
+        return;
+    }
+
+    Request::Type add   = row ? Request::Type::RowAdd : Request::Type::ColAdd,
+                  sub   = row ? Request::Type::RowSub : Request::Type::ColSub,
+                  shift = row ? Request::Type::RowBitwise : Request::Type::ColBitwise;
+    int n = size / (2 * bits);
+    if (n < 1)
+        n = 1;
+    if (type == add || type == sub) {
+        ops.push_back(make_pair(sub, 2 * exp * n));     // exponent difference
+        ops.push_back(make_pair(shift, mant * n));      // align mantissas
+        ops.push_back(make_pair(type, 2 * mant * n));
+        ops.push_back(make_pair(shift, mant * n));      // normalize
+    } else {
+        ops.push_back(make_pair(type, 2 * mant * n));
+        ops.push_back(make_pair(type == Request::Type::RowMul || type == Request::Type::ColMul 
+                                ? add : sub, 2 * exp * n));
+        ops.push_back(make_pair(shift, mant * n));      // normalize
+    }
+}
+
+void
+System::setPrefetch(bool enable)
+{
+    _prefetch = enable;
+}
+
+int
+System::prefetch(Request& req)
+{
+    /* The transfer is admitted to the chips but not waited for, so it runs
+     * while the following requests compute. The next sendRequest (or
+     * completeRequests) waits for both. */
+    _prefetch_reqs++;
+    return dispatchRequest(req);
+}
+
+int
+System::transpose(AddrT src_addr, AddrT dst_addr, int n_rows, int n_cols)
+{
+    /* Row i of the n_rows x n_cols tile at src_addr becomes column i of the
+     * tile at dst_addr. The whole tile is issued back to back through the
+     * row and column buffers and waited for once, instead of one
+     * Row2Col request (and one synchronization) per element range. */
+    if (n_rows <= 0 || n_cols <= 0) {
+        cout << "[Error] transpose of a " << n_rows << "x" << n_cols << " tile!\n";
+        return -1;
+    }
+    int src_chip = 0, src_tile = 0, src_block = 0, src_row = 0, src_col = 0,
+        dst_chip = 0, dst_tile = 0, dst_block = 0, dst_row = 0, dst_col = 0;
+    getLocation(src_addr, src_chip, src_tile, src_block, src_row, src_col);
+    getLocation(dst_addr, dst_chip, dst_tile, dst_block, dst_row, dst_col);
+
+    if ((src_row + n_rows > _nrows) || (src_col + n_cols > _ncols) ||
+        (dst_row + n_cols > _nrows) || (dst_col + n_rows > _ncols)) {
+        cout << "[Error] transposed " << n_rows << "x" << n_cols << " tile runs off its block!\n";
+        return -1;
+    }
+
+    tot_reqs++;
+    if (_functional) {
+        for (int i = 0; i < n_rows; i++)
+            funcMove(src_addr + (AddrT)i * _ncols, true, dst_addr + i, false, n_cols);
+    }
+
+    int tot_clks = 0;
+    if (src_chip != dst_chip) {
+        /* Stage the tile, cross the network once, then scatter it */
+        Request buffer_read_req(Request::Type::RowBufferRead);
+        for (int i = 0; i < n_rows; i++)
+            buffer_read_req.addAddr(src_addr + (AddrT)i * _ncols, n_cols);
+        tot_clks += sendRowBuffer(buffer_read_req);
+
+        vector<uint8_t> tile, row;
+        if (_functional && _compress != Compression::None) {
+            for (int i = 0; i < n_rows; i++) {
+                funcRead(src_addr + (AddrT)i * _ncols, true, n_cols, row);
+                tile.insert(tile.end(), row.begin(), row.end());
+            }
+        }
+        tot_clks += sendTransfer(src_addr, dst_addr, n_rows * n_cols, true, 
+                                 tile.empty() ? NULL : &tile);
+
+        Request buffer_write_req(Request::Type::ColBufferWrite);
+        for (int i = 0; i < n_rows; i++)
+            buffer_write_req.addAddr(dst_addr + i, n_cols);
+        tot_clks += sendColBuffer(buffer_write_req);
+    } else {
+        for (int i = 0; i < n_rows; i++) {
+            Request buffer_read_req(Request::Type::RowBufferRead);
+            buffer_read_req.addAddr(src_addr + (AddrT)i * _ncols, n_cols);
+            tot_clks += sendRowBuffer(buffer_read_req);
+
+            Request buffer_write_req(Request::Type::ColBufferWrite);
+            buffer_write_req.addAddr(dst_addr + i, n_cols);
+            tot_clks += sendColBuffer(buffer_write_req);
+        }
+    }
+    completeRequests();
+    return tot_clks;
+}
+
+System::ScanResult
+System::scan(int first_block, uint64_t n_records, int key_bits, uint64_t key, bool along_rows,
+             int n_chips)
+{
+    /* The table is stored key-per-record from column (row) 0 of each block,
+     * one record per row when along_rows, one per column otherwise.
+     * Consecutive groups of records go to the same block range on every
+     * chip in turn, so a scan keeps all chips busy; n_chips > 0 keeps the
+     * table on the first n_chips chips instead. Every block gets the
+     * key broadcast next to its records, one Row/ColSearch over all its
+     * records, and a single buffer read of the resulting match bitmap. */
+    ScanResult result = {0, 0, 0, 0.0};
+    int per_block = along_rows ? _nrows : _ncols;
+    int field_len = along_rows ? _ncols : _nrows;
+    if (n_chips <= 0 || n_chips > _nchips)
+        n_chips = _nchips;
+    if (first_block < 0 || first_block >= _ntiles * _nblocks) {
+        cout << "[Error] cannot scan from block " << first_block << ", chips have " 
+             << _ntiles * _nblocks << " blocks!\n";
+        return result;
+    }
+    if (key_bits <= 0 || key_bits > 64 || 3 * key_bits > field_len) {
+        cout << "[Error] cannot scan " << key_bits << "-bit keys, records hold " 
+             << field_len << " bits!\n";
+        return result;
+    }
+    int blocks_per_chip = _ntiles * _nblocks - first_block;
+    uint64_t capacity = (uint64_t)blocks_per_chip * n_chips * per_block;
+    if (n_records > capacity) {
+        cout << "[Error] scanning " << n_records << " records, only " << capacity 
+             << " fit from block " << first_block << "!\n";
+        return result;
+    }
+
+    TimeT start = 0;
+    for (int i = 0; i < _nchips; i++)
+        start = std::max(start, chipTime(i));
+
+    vector<pair<AddrT, int>> bitmaps;
+    for (uint64_t done = 0, b = 0; done < n_records; b++) {
+        int chip = b % n_chips;
+        int local = first_block + b / n_chips;
+        int recs = (int)std::min<uint64_t>(per_block, n_records - done);
+        AddrT base = getAddress(chip, local / _nblocks, local % _nblocks, 0, 0);
+        AddrT step = along_rows ? (AddrT)_ncols : 1;    // next record
+        AddrT bit = along_rows ? 1 : (AddrT)_ncols;     // next bit of a record
+
+        /* Broadcast the key, one buffer write per key bit */
+        for (int j = 0; j < key_bits; j++) {
+            Request bcast(along_rows ? Request::Type::ColBufferWrite 
+                                     : Request::Type::RowBufferWrite);
+            bcast.addAddr(base + (key_bits + j) * bit, recs);
+            if (_functional)
+                _func_buffer.assign(recs, (key >> j) & 1);
+            dispatchRequest(bcast);
+        }
+
+        Request search(along_rows ? Request::Type::RowSearch : Request::Type::ColSearch);
+        for (int r = 0; r < recs; r++) {
+            search.addAddr(base + r * step, 2 * key_bits);
+            if (!along_rows)
+                search.addAddr(base + r * step + 2 * key_bits * bit, 1);  // match bit
+        }
+        dispatchRequest(search);
+
+        AddrT match = base + 2 * key_bits * bit;
+        Request gather(along_rows ? Request::Type::ColBufferRead 
+                                  : Request::Type::RowBufferRead);
+        gather.addAddr(match, recs);
+        dispatchRequest(gather);
+        bitmaps.push_back(make_pair(match, recs));
+        done += recs;
+    }
+    completeRequests();
+
+    TimeT end = 0;
+    for (int i = 0; i < _nchips; i++)
+        end = std::max(end, chipTime(i));
+    result.records = n_records;
+    result.cycles = end - start;
+    if (result.cycles > 0)
+        result.records_per_sec = n_records / (result.cycles * 1e-6 / _clock_rate);
+    if (_functional) {
+        vector<uint8_t> bits;
+        for (auto& bm : bitmaps) {
+            funcRead(bm.first, !along_rows, bm.second, bits);
+            for (uint8_t m : bits)
+                result.matches += m;
+        }
+    }
+    return result;
+}
+
+void
+System::scan_benchmark()
+{
+    /* Scans of 32-bit keys filling one block, one tile and one chip of
+     * chip 0, then every chip, so each row shows what one more level of
+     * the hierarchy adds to the scan rate */
+    fprintf(rstFile, "\n############# Scan ################\n");
+    uint64_t per_tile = (uint64_t)_nblocks * _nrows;
+    uint64_t per_chip = per_tile * _ntiles;
+    struct {
+        const char* level;
+        uint64_t records;
+        int chips;
+    } levels[] = {
+        {"block", (uint64_t)_nrows, 1},
+        {"tile", per_tile, 1},
+        {"chip", per_chip, 1},
+        {"system", per_chip * _nchips, _nchips},
+    };
+    for (auto& l : levels) {
+        ScanResult res = scan(0, l.records, 32, 0x5eed, true, l.chips);
+        fprintf(rstFile, "Scan of one %s, %lu records: %lu clocks, %.4e records/s\n",
+                l.level, res.records, res.cycles, res.records_per_sec);
+    }
+}
+
+Request&
+System::batchAdd(int chip, int block, Request::Type type)
+{
+    /* Kernels collect one request per block and operation, then issue all
+     * blocks together and wait once in batchFlush() */
+    auto key = make_pair(chip, block);
+    auto it = _batch.find(key);
+    if (it == _batch.end())
+        it = _batch.insert(make_pair(key, Request(type))).first;
+    return it->second;
+}
+
+void
+System::batchFlush()
+{
+    for (auto& b : _batch)
+        dispatchRequest(b.second);
+    completeRequests();
+    _batch.clear();
+}
+
+AddrT
+System::vectorElem(AddrT base, uint64_t idx, int bits)
+{
+    /* Vectors in the storage region are packed ncols/bits elements per row */
+    int per_row = _ncols / bits;
+    return base + (AddrT)(idx / per_row) * _ncols + (AddrT)(idx % per_row) * bits;
+}
+
+namespace {
+
+/* A run of consecutive nonzeros of one sparse row, packed one nonzero per
+ * block column into a band of rows. Values are stored down the column,
+ * bits wide, in five fields: A, the gathered x, the product, a partner
+ * operand and the sum, which is the layout column operations expect
+ * (operand B right below A, the result right below B). */
+struct SpmvSegment {
+    int chip;
+    int block;      // block index inside the chip
+    int band;       // band of 5 fields down the block
+    int col;        // first block column
+    int len;
+    int sparse_row;
+    int first_nz;
+    int head;       // index of the first segment of this sparse row
+};
+
+}
+
+void System::spmv_coo(int n_rows, int n_cols, const std::vector<int>& rows,
+                      const std::vector<int>& cols, const std::vector<uint64_t>& values,
+                      int n_vecs, Precision p)
+{
+    if (n_rows < 0 || rows.size() != cols.size() || rows.size() != values.size()) {
+        cout << "[Error] SpMV needs one row, column and value per nonzero!\n";
+        return;
+    }
+    for (size_t i = 0; i < rows.size(); i++) {
+        if (rows[i] < 0 || rows[i] >= n_rows || cols[i] < 0 || cols[i] >= n_cols) {
+            cout << "[Error] SpMV nonzero #" << i << " at (" << rows[i] << ", " << cols[i] 
+                 << ") is outside the " << n_rows << "x" << n_cols << " matrix!\n";
+            return;
+        }
+    }
+    /* Counting sort into CSR, entries keep their order within a row */
+    std::vector<int> row_ptr(n_rows + 1, 0), col_idx(cols.size());
+    std::vector<uint64_t> vals(values.size());
+    for (size_t i = 0; i < rows.size(); i++)
+        row_ptr[rows[i] + 1]++;
+    for (int r = 0; r < n_rows; r++)
+        row_ptr[r + 1] += row_ptr[r];
+    std::vector<int> fill(row_ptr.begin(), row_ptr.end() - 1);
+    for (size_t i = 0; i < rows.size(); i++) {
+        int k = fill[rows[i]]++;
+        col_idx[k] = cols[i];
+        vals[k] = values[i];
+    }
+    spmv_csr(n_rows, n_cols, row_ptr, col_idx, vals, n_vecs, p);
+}
+
+void System::spmv_csr(int n_rows, int n_cols, const std::vector<int>& row_ptr,
+                      const std::vector<int>& col_idx, const std::vector<uint64_t>& values,
+                      int n_vecs, Precision p)
+{
+    spmvStorage(n_rows, n_cols, row_ptr, col_idx, &values, n_vecs, p);
+}
+
+void
+System::spmvStorage(int n_rows, int n_cols, const vector<int>& row_ptr, const vector<int>& col_idx,
+                    const vector<uint64_t>* values, int n_vecs, Precision p)
+{
+    /* Storage units are the last quarter of chip 0's blocks and hold, one
+     * after the other and each starting on a fresh row: the nonzero values
+     * of A, the n_vecs x vectors and the n_vecs y vectors, packed
+     * ncols/bits elements per row (see vectorElem). In functional mode the
+     * values are placed there by the kernel unless values is NULL, in which
+     * case the caller has put them there already. x is expected to be there
+     * too, and y holds the result afterwards. */
+    int bits = precisionBits(p);
+    int nnz = n_rows >= 0 && (int)row_ptr.size() == n_rows + 1 ? row_ptr[n_rows] : -1;
+    if (nnz < 0 || (int)col_idx.size() < nnz || (values && (int)values->size() != nnz)) {
+        cout << "[Error] SpMV needs n_rows + 1 row pointers and one column index and value per nonzero!\n";
+        return;
+    }
+    for (int nz = 0; nz < nnz; nz++) {
+        if (col_idx[nz] < 0 || col_idx[nz] >= n_cols) {
+            cout << "[Error] SpMV column index " << col_idx[nz] << " is outside the " 
+                 << n_cols << " columns!\n";
+            return;
+        }
+    }
+    int pim_blocks = _ntiles * _nblocks * 3 / 4;
+    int per_row = _ncols / bits;
+    if (pim_blocks <= 0 || per_row <= 0) {
+        cout << "[Error] SpMV needs storage and PIM blocks!\n";
+        return;
+    }
+    AddrT storage_start_address = getAddress(0, pim_blocks / _nblocks, pim_blocks % _nblocks, 0, 0);
+    AddrT a_rows = (nnz + per_row - 1) / per_row,
+          x_rows = (n_cols + per_row - 1) / per_row,
+          y_rows = (n_rows + per_row - 1) / per_row;
+    AddrT storage_rows = (AddrT)(_ntiles * _nblocks - pim_blocks) * _nrows;
+    if (a_rows + (AddrT)n_vecs * (x_rows + y_rows) > storage_rows) {
+        cout << "[Error] SpMV values and vectors do not fit into chip 0's storage blocks!\n";
+        return;
+    }
+    AddrT a_base = storage_start_address,
+          x_base = a_base + a_rows * _ncols,
+          y_base = x_base + (AddrT)n_vecs * x_rows * _ncols;
+    if (_functional && values) {
+        for (int nz = 0; nz < nnz; nz++)
+            writeValue(vectorElem(a_base, nz, bits), (*values)[nz], bits, true);
+    }
+    spmvRun(n_rows, n_cols, row_ptr, col_idx, n_vecs, p,
+            [&](int nz) { return vectorElem(a_base, nz, bits); },
+            [&](int v, int j) { return vectorElem(x_base + (AddrT)v * x_rows * _ncols, j, bits); },
+            [&](int v, int i) { return vectorElem(y_base + (AddrT)v * y_rows * _ncols, i, bits); });
+}
+
+bool
+System::spmvRun(int n_rows, int n_cols, const vector<int>& row_ptr, const vector<int>& col_idx,
+                int n_vecs, Precision p, const function<AddrT(int)>& a_at,
+                const function<AddrT(int, int)>& x_at, const function<AddrT(int, int)>& y_at)
+{
+    /* The SpMV pipeline over storage locations given by the caller: nonzero
+     * nz of A at a_at(nz), element j of vector v at x_at(v, j) and element
+     * i of its result at y_at(v, i) */
+    int bits = precisionBits(p);
+    int nnz = row_ptr[n_rows];
+    int pim_blocks = _ntiles * _nblocks * 3 / 4;        // blocks per chip outside storage
+    int bands = _nrows / (5 * bits);                    // nonzero bands per block
+    if (pim_blocks <= 0 || bands <= 0) {
+        cout << "[Error] SpMV needs PIM blocks of at least " << 5 * bits << " rows!\n";
+        return false;
+    }
+    Precision saved_precision = _precision;
+    _precision = p;
+
+    //------------------------balance rows over chips by nonzeros------------------------//
+    std::vector<int> chip_first(_nchips + 1, n_rows);
+    int r = 0;
+    chip_first[0] = 0;
+    for (int c = 1; c < _nchips; c++) {
+        long target = (long)nnz * c / _nchips;
+        while (r < n_rows && row_ptr[r] < target)
+            r++;
+        chip_first[c] = r;
+    }
+
+    //------------------------pack nonzeros into block columns------------------------//
+    std::vector<SpmvSegment> segs;
+    std::vector<int> chip_blocks(_nchips, 0);
+    int max_len = 0, max_chunks = 0, max_chip_nnz = 0;
+    for (int c = 0; c < _nchips; c++) {
+        int block = 0, band = 0, cursor = 0;
+        max_chip_nnz = std::max(max_chip_nnz, row_ptr[chip_first[c+1]] - row_ptr[chip_first[c]]);
+        for (int sr = chip_first[c]; sr < chip_first[c+1]; sr++) {
+            int head = segs.size();
+            for (int nz = row_ptr[sr]; nz < row_ptr[sr+1]; ) {
+                int len = std::min(row_ptr[sr+1] - nz, _ncols);
+                if (cursor + len > _ncols) {
+                    cursor = 0;
+                    if (++band == bands) {
+                        band = 0;
+                        block++;
+                    }
+                }
+                SpmvSegment seg = {c, block, band, cursor, len, sr, nz, head};
+                segs.push_back(seg);
+                cursor += len;
+                nz += len;
+                max_len = std::max(max_len, len);
+            }
+            max_chunks = std::max(max_chunks, (int)segs.size() - head);
+        }
+        chip_blocks[c] = cursor > 0 || band > 0 ? block + 1 : block;
+        if (chip_blocks[c] > pim_blocks) {
+            cout << "[Error] SpMV matrix does not fit into the PIM blocks!\n";
+            _precision = saved_precision;
+            return false;
+        }
+    }
+
+    auto cell = [&](const SpmvSegment& s, int i, int field) {
+        return getAddress(s.chip, s.block / _nblocks, s.block % _nblocks,
+                          (s.band * 5 + field) * bits, s.col + i);
+    };
+    auto add_to = [&](const SpmvSegment& s, Request::Type type) -> Request& {
+        return batchAdd(s.chip, s.block, type);
+    };
+    /* One column operation: its operand pair, then where the result goes,
+     * the stride sendColPIM walks */
+    auto col_op = [&](const SpmvSegment& s, Request::Type type, int i, int field) {
+        Request& req = add_to(s, type);
+        req.addAddr(cell(s, i, field), 2 * bits);
+        req.addAddr(cell(s, i, field + 2), bits);
+    };
+
+    TimeT start = 0;
+    for (int i = 0; i < _nchips; i++)
+        start = std::max(start, chipTime(i));
+
+    //------------------------load A into the blocks, once------------------------//
+    for (const SpmvSegment& s : segs) {
+        Request& req = add_to(s, Request::Type::SystemRow2Col);
+        for (int i = 0; i < s.len; i++) {
+            req.addAddr(a_at(s.first_nz + i), bits);
+            req.addAddr(cell(s, i, 0), bits);
+        }
+    }
+    batchFlush();
+
+    for (int v = 0; v < n_vecs; v++) {
+        //------------------------gather x below every nonzero------------------------//
+        for (const SpmvSegment& s : segs) {
+            Request& req = add_to(s, Request::Type::SystemRow2Col);
+            for (int i = 0; i < s.len; i++) {
+                req.addAddr(x_at(v, col_idx[s.first_nz + i]), bits);
+                req.addAddr(cell(s, i, 1), bits);
+            }
+        }
+        batchFlush();
+
+        //------------------------multiply------------------------//
+        for (const SpmvSegment& s : segs) {
+            for (int i = 0; i < s.len; i++)
+                col_op(s, Request::Type::ColMul, i, 0);
+        }
+        batchFlush();
+
+        //------------------------tree reduction across the columns------------------------//
+        for (int stride = 1; stride < max_len; stride *= 2) {
+            for (const SpmvSegment& s : segs) {
+                if (s.len <= stride)
+                    continue;
+                Request& req = add_to(s, Request::Type::ColMv);
+                for (int i = 0; i + stride < s.len; i += 2 * stride) {
+                    req.addAddr(cell(s, i + stride, 2), bits);
+                    req.addAddr(cell(s, i, 3), bits);
+                }
+            }
+            batchFlush();
+            for (const SpmvSegment& s : segs) {
+                for (int i = 0; i + stride < s.len; i += 2 * stride)
+                    col_op(s, Request::Type::ColAdd, i, 2);
+            }
+            batchFlush();
+            for (const SpmvSegment& s : segs) {
+                if (s.len <= stride)
+                    continue;
+                Request& req = add_to(s, Request::Type::ColMv);
+                for (int i = 0; i + stride < s.len; i += 2 * stride) {
+                    req.addAddr(cell(s, i, 4), bits);
+                    req.addAddr(cell(s, i, 2), bits);
+                }
+            }
+            batchFlush();
+        }
+
+        //------------------------merge rows split over several segments------------------------//
+        for (int k = 1; k < max_chunks; k++) {
+            std::vector<const SpmvSegment*> merges;
+            for (size_t i = 0; i < segs.size(); i++) {
+                if ((int)i == segs[i].head + k)
+                    merges.push_back(&segs[i]);
+            }
+            for (const SpmvSegment* s : merges) {
+                Request& req = add_to(segs[s->head], Request::Type::SystemCol2Col);
+                req.addAddr(cell(*s, 0, 2), bits);
+                req.addAddr(cell(segs[s->head], 0, 3), bits);
+            }
+            batchFlush();
+            for (const SpmvSegment* s : merges)
+                col_op(segs[s->head], Request::Type::ColAdd, 0, 2);
+            batchFlush();
+            for (const SpmvSegment* s : merges) {
+                Request& req = add_to(segs[s->head], Request::Type::ColMv);
+                req.addAddr(cell(segs[s->head], 0, 4), bits);
+                req.addAddr(cell(segs[s->head], 0, 2), bits);
+            }
+            batchFlush();
+        }
+
+        //------------------------send y back to storage------------------------//
+        for (size_t i = 0; i < segs.size(); i++) {
+            const SpmvSegment& s = segs[i];
+            if ((int)i != s.head)
+                continue;
+            Request& req = add_to(s, Request::Type::SystemCol2Row);
+            req.addAddr(cell(s, 0, 2), bits);
+            req.addAddr(y_at(v, s.sparse_row), bits);
+        }
+        batchFlush();
+    }
+
+    TimeT end = 0;
+    int used_blocks = 0;
+    for (int i = 0; i < _nchips; i++) {
+        end = std::max(end, chipTime(i));
+        used_blocks += chip_blocks[i];
+    }
+    double seconds = (end - start) * 1e-6 / _clock_rate;
+    double flops = 2.0 * nnz * n_vecs,
+           dense_flops = 2.0 * n_rows * n_cols * n_vecs;
+    fprintf(rstFile, "\n############# SpMV ################\n");
+    fprintf(rstFile, "SpMV %dx%d with %d nonzeros, %d vectors: %lu clocks\n",
+            n_rows, n_cols, nnz, n_vecs, end - start);
+    fprintf(rstFile, "Nonzeros per chip: max %d, avg %.1lf\n",
+            max_chip_nnz, (double)nnz / _nchips);
+    fprintf(rstFile, "PIM blocks used: %d (dense packing needs %lu)\n", used_blocks,
+            ((AddrT)n_rows * n_cols + (AddrT)bands * _ncols - 1) / ((AddrT)bands * _ncols));
+    if (seconds > 0) {
+        fprintf(rstFile, "Effective throughput: %.4lf GFLOP/s\n", flops / seconds * 1e-9);
+        fprintf(rstFile, "Dense-equivalent throughput: %.4lf GFLOP/s\n", dense_flops / seconds * 1e-9);
+    }
+
+    _precision = saved_precision;
+    return true;
+}
+
+System&
+System::probeSystem()
+{
+    /* One single-chip copy of this geometry serves every microbenchmark.
+     * Each measurement waits until the chip is idle again and takes the
+     * difference in time and energy, so nothing has to be rebuilt. */
+    if (!_probe) {
+        DesignPoint point = {1, _ntiles, _nblocks, _nrows, _ncols, "ideal", "/dev/null"};
+        _probe = new System(_config, point);
+    }
+    return *_probe;
+}
+
+double
+System::probeCost(Request::Type type, int size)
+{
+    /* Latency of a single request on the idle single-chip copy of this
+     * system, at the current precision, so kernel mappers can compare plans
+     * in real chip cycles */
+    auto key = make_tuple((int)type, size, (int)_precision);
+    auto it = _probe_costs.find(key);
+    if (it != _probe_costs.end())
+        return it->second;
+
+    System& probe = probeSystem();
+    probe._precision = _precision;
+    TimeT t0 = probe.chipTime(0);
+    AddrT storage = (AddrT)_ncols * _nrows * _nblocks * _ntiles / 4 * 3;
+    Request req(type);
+    req.addAddr(type == Request::Type::SystemRow2Row ? storage : 0, size);
+    if (type == Request::Type::SystemRow2Row || type == Request::Type::RowMv 
+            || type == Request::Type::ColMv)
+        req.addAddr(type == Request::Type::ColMv ? 1 : _ncols, size);
+    probe.sendRequest(req);
+    double cost = probe.chipTime(0) - t0;
+    _probe_costs[key] = cost;
+    return cost;
+}
+
+void System::conv2d(int N, int C, int H, int W, int K, int R, int S, int stride, Precision p)
+{
+    /* Storage units hold, each starting on a fresh row, the input (NCHW),
+     * the filters (K x CRS), the output (NKPQ) and, for im2col, the lowered
+     * input with one CRS vector per output pixel */
+    if (N <= 0 || C <= 0 || H <= 0 || W <= 0 || K <= 0 || R <= 0 || S <= 0 || stride <= 0) {
+        cout << "[Error] convolution dimensions and stride must be positive!\n";
+        return;
+    }
+    if (H < R || W < S) {
+        cout << "[Error] a " << R << "x" << S << " filter does not fit a " << H << "x" << W << " input!\n";
+        return;
+    }
+    int bits = precisionBits(p);
+    int P = (H - R) / stride + 1, Q = (W - S) / stride + 1;
+    int taps = C * R * S;
+    double outs = (double)N * P * Q;
+    int pim_blocks = _ntiles * _nblocks * 3 / 4;
+    int per_row = _ncols / bits;
+    if (pim_blocks <= 0 || per_row <= 0) {
+        cout << "[Error] convolution needs storage and PIM blocks!\n";
+        return;
+    }
+    Precision saved_precision = _precision;
+    _precision = p;
+
+    AddrT x_rows = ((AddrT)N * C * H * W + per_row - 1) / per_row,
+          w_rows = ((AddrT)K * taps + per_row - 1) / per_row,
+          y_rows = ((AddrT)N * K * P * Q + per_row - 1) / per_row,
+          l_rows = (taps + per_row - 1) / per_row;
+    AddrT storage_rows = (AddrT)(_ntiles * _nblocks - pim_blocks) * _nrows;
+    if (x_rows + w_rows + y_rows > storage_rows) {
+        cout << "[Error] convolution tensors do not fit into chip 0's storage blocks!\n";
+        _precision = saved_precision;
+        return;
+    }
+    AddrT x_base = getAddress(0, pim_blocks / _nblocks, pim_blocks % _nblocks, 0, 0);
+    AddrT w_base = x_base + x_rows * _ncols;
+    AddrT y_base = w_base + w_rows * _ncols;
+    AddrT l_base = y_base + y_rows * _ncols;
+    auto x_elem = [&](int n, int c, int h, int w) {
+        return vectorElem(x_base, (((AddrT)n * C + c) * H + h) * W + w, bits);
+    };
+    auto y_elem = [&](int n, int k, int op, int oq) {
+        return vectorElem(y_base, (((AddrT)n * K + k) * P + op) * Q + oq, bits);
+    };
+
+    //------------------------cost estimate of both mappings------------------------//
+    double t_gather = probeCost(Request::Type::SystemRow2Row, bits),
+           t_mul    = probeCost(Request::Type::RowMul, 2*bits),
+           t_cadd   = probeCost(Request::Type::ColAdd, 2*bits),
+           t_radd   = probeCost(Request::Type::RowAdd, 2*bits),
+           t_rmove  = probeCost(Request::Type::RowMv, bits),
+           t_move   = probeCost(Request::Type::ColMv, S > stride ? S - stride : 1);
+    //im2col: lower the input into one CRS vector per output pixel, then stream
+    //those through the SpMV pipeline against the K x CRS filter matrix
+    bool lowered_fits = x_rows + w_rows + y_rows + (AddrT)N * P * Q * l_rows <= storage_rows;
+    double rows_blk = std::min<double>(_nrows, (double)K * taps);
+    double est_im2col = lowered_fits ? outs * taps * t_gather + outs * rows_blk * (2 * t_gather + t_mul + t_cadd) : -1;
+    //direct: one block per output channel, windows slide by moving the input column
+    bool reuse = stride < S;
+    double per_pos = taps * (t_mul + t_radd + 2 * t_rmove) + t_gather 
+                   + (double)C * R * (reuse ? stride * t_gather + bits * t_move : S * t_gather);
+    int waves = (K + _nchips * pim_blocks - 1) / (_nchips * pim_blocks);
+    double est_direct = (taps <= _nrows && 5 * bits <= _ncols) ? waves * outs * per_pos : -1;
+
+    if (est_im2col < 0 && est_direct < 0) {
+        cout << "[Error] neither convolution mapping fits this system!\n";
+        _precision = saved_precision;
+        return;
+    }
+    bool direct = est_direct >= 0 && (est_im2col < 0 || est_direct < est_im2col);
+    TimeT start = 0;
+    for (int i = 0; i < _nchips; i++)
+        start = std::max(start, chipTime(i));
+
+    if (!direct) {
+        //------------------------lower the input------------------------//
+        for (int n = 0; n < N; n++)
+        for (int op = 0; op < P; op++)
+        for (int oq = 0; oq < Q; oq++) {
+            AddrT lv_base = l_base + (((AddrT)n * P + op) * Q + oq) * l_rows * _ncols;
+            Request& req = batchAdd(0, pim_blocks, Request::Type::SystemRow2Row);
+            for (int c = 0; c < C; c++)
+                for (int r = 0; r < R; r++)
+                    for (int s2 = 0; s2 < S; s2++) {
+                        req.addAddr(x_elem(n, c, op * stride + r, oq * stride + s2), bits);
+                        req.addAddr(vectorElem(lv_base, (c * R + r) * S + s2, bits), bits);
+                    }
+        }
+        batchFlush();
+
+        std::vector<int> row_ptr(K + 1), col_idx((size_t)K * taps);
+        for (int k = 0; k <= K; k++)
+            row_ptr[k] = k * taps;
+        for (size_t i = 0; i < col_idx.size(); i++)
+            col_idx[i] = i % taps;
+        if (!spmvRun(K, taps, row_ptr, col_idx, N * P * Q, p,
+                     [&](int nz) { return vectorElem(w_base, nz, bits); },
+                     [&](int v, int t) { return vectorElem(l_base + (AddrT)v * l_rows * _ncols, t, bits); },
+                     [&](int v, int k) { return y_elem(v / (P * Q), k, v / Q % P, v % Q); })) {
+            _precision = saved_precision;
+            return;
+        }
+    } else {
+        //block row (c, r, s) holds weight in field 0, input in field 1, product in
+        //field 2, the partner product in field 3 and their sum in field 4
+        auto cell = [&](int k, int row, int field) {
+            int local = (k / _nchips) % pim_blocks;
+            return getAddress(k % _nchips, local / _nblocks, local % _nblocks, row, field * bits);
+        };
+        auto block_of = [&](int k) { return (k / _nchips) % pim_blocks; };
+        //output channels go round robin over the chips, one block each
+        for (int k0 = 0; k0 < K; k0 += _nchips * pim_blocks) {
+            int k1 = std::min(K, k0 + _nchips * pim_blocks);
+            //------------------------load filters------------------------//
+            for (int k = k0; k < k1; k++) {
+                Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::SystemRow2Row);
+                for (int t = 0; t < taps; t++) {
+                    req.addAddr(vectorElem(w_base, (AddrT)k * taps + t, bits), bits);
+                    req.addAddr(cell(k, t, 0), bits);
+                }
+            }
+            batchFlush();
+
+            for (int n = 0; n < N; n++)
+            for (int op = 0; op < P; op++)
+            for (int oq = 0; oq < Q; oq++) {
+                //------------------------bring in the window------------------------//
+                if (oq > 0 && reuse) {
+                    //slide: every (c, r) group moves up by stride rows, bit column by bit column
+                    for (int k = k0; k < k1; k++) {
+                        Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::ColMv);
+                        for (int g = 0; g < C * R; g++)
+                            for (int b = 0; b < bits; b++) {
+                                req.addAddr(cell(k, g * S + stride, 1) + b, S - stride);
+                                req.addAddr(cell(k, g * S, 1) + b, S - stride);
+                            }
+                    }
+                    batchFlush();
+                }
+                int s_first = (oq > 0 && reuse) ? S - stride : 0;
+                for (int k = k0; k < k1; k++) {
+                    Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::SystemRow2Row);
+                    for (int c = 0; c < C; c++)
+                        for (int r = 0; r < R; r++)
+                            for (int s2 = s_first; s2 < S; s2++) {
+                                req.addAddr(x_elem(n, c, op * stride + r, oq * stride + s2), bits);
+                                req.addAddr(cell(k, (c * R + r) * S + s2, 1), bits);
+                            }
+                }
+                batchFlush();
+                //------------------------multiply------------------------//
+                for (int k = k0; k < k1; k++) {
+                    Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::RowMul);
+                    for (int t = 0; t < taps; t++)
+                        req.addAddr(cell(k, t, 0), 2*bits);
+                }
+                batchFlush();
+                //------------------------reduce------------------------//
+                //pair up the products in a tree: bring the partner row's product
+                //next to this row's, add them, and move the sum back into place
+                for (int stride2 = 1; stride2 < taps; stride2 *= 2) {
+                    for (int k = k0; k < k1; k++) {
+                        Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::RowMv);
+                        for (int t = 0; t + stride2 < taps; t += 2 * stride2) {
+                            req.addAddr(cell(k, t + stride2, 2), bits);
+                            req.addAddr(cell(k, t, 3), bits);
+                        }
+                    }
+                    batchFlush();
+                    for (int k = k0; k < k1; k++) {
+                        Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::RowAdd);
+                        for (int t = 0; t + stride2 < taps; t += 2 * stride2)
+                            req.addAddr(cell(k, t, 2), 2*bits);
+                    }
+                    batchFlush();
+                    for (int k = k0; k < k1; k++) {
+                        Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::RowMv);
+                        for (int t = 0; t + stride2 < taps; t += 2 * stride2) {
+                            req.addAddr(cell(k, t, 4), bits);
+                            req.addAddr(cell(k, t, 2), bits);
+                        }
+                    }
+                    batchFlush();
+                }
+                //------------------------write the output pixel------------------------//
+                for (int k = k0; k < k1; k++) {
+                    Request& req = batchAdd(k % _nchips, block_of(k), Request::Type::SystemRow2Row);
+                    req.addAddr(cell(k, 0, 2), bits);
+                    req.addAddr(y_elem(n, k, op, oq), bits);
+                }
+                batchFlush();
+            }
+        }
+    }
+    _precision = saved_precision;
+
+    TimeT end = 0;
+    for (int i = 0; i < _nchips; i++)
+        end = std::max(end, chipTime(i));
+    fprintf(rstFile, "\n############# Conv2d ##############\n");
+    fprintf(rstFile, "Conv N=%d C=%d H=%d W=%d K=%d R=%d S=%d stride=%d\n",
+            N, C, H, W, K, R, S, stride);
+    fprintf(rstFile, "Estimated clocks: im2col %.0lf, direct %.0lf\n", est_im2col, est_direct);
+    fprintf(rstFile, "Mapping: %s, %lu clocks\n", direct ? "direct" : "im2col", end - start);
+}
+
+TimeT
+System::sort(int first_block, uint64_t n_keys, int key_bits, bool descending)
+{
+    /* Bitonic sort of unsigned keys stored one per row in column 0 of
+     * consecutive blocks, laid out over the chips like scan(). Key g lives
+     * in row g % nrows of block g / nrows. Every compare-exchange step:
+     *  - fetches the partner key into field 1 of each row, by RowMv inside
+     *    a block or by a SystemRow2Row transfer between blocks and chips,
+     *  - compares both fields with one RowSub per block, keys being
+     *    key_bits + 1 wide so the sign of the difference is the result,
+     *  - reads the sign column out with one ColBufferRead per block,
+     *  - moves field 1 over field 0 in the rows that take their partner.
+     * Without functional data the swapping rows are unknown, so the half
+     * of the rows that are the upper of their pair is charged. The first
+     * k keys of a descending sort are the top-k. */
+    int fw = key_bits + 1;
+    int blocks_per_chip = _ntiles * _nblocks - first_block;
+    if (key_bits <= 0 || key_bits > 63 || 3 * fw > _ncols || first_block < 0 || blocks_per_chip <= 0) {
+        cout << "[Error] cannot sort " << key_bits << "-bit keys from block " 
+             << first_block << "!\n";
+        return 0;
+    }
+    /* Keys are padded to a power of two, which must fit in the blocks */
+    uint64_t capacity = (uint64_t)blocks_per_chip * _nchips * _nrows;
+    uint64_t n = 1;
+    while (n < n_keys)
+        n *= 2;
+    if (n > capacity) {
+        cout << "[Error] sorting " << n_keys << " keys needs " << n 
+             << " rows, only " << capacity << " are available!\n";
+        return 0;
+    }
+    /* Partners g ^ j of a step within a block must stay in that block */
+    if (n > (uint64_t)_nrows && (_nrows & (_nrows - 1))) {
+        cout << "[Error] sorting across blocks needs a power-of-two row count, not " 
+             << _nrows << "!\n";
+        return 0;
+    }
+    uint64_t n_blocks = (n + _nrows - 1) / _nrows;
+    int rows = (int)std::min<uint64_t>(n, _nrows);
+
+    auto block_chip = [&](uint64_t b) { return (int)(b % _nchips); };
+    auto block_local = [&](uint64_t b) { return first_block + (int)(b / _nchips); };
+    auto key_addr = [&](uint64_t g, int field) {
+        uint64_t b = g / _nrows;
+        int local = block_local(b);
+        return getAddress(block_chip(b), local / _nblocks, local % _nblocks, 
+                          (int)(g % _nrows), field * fw);
+    };
+
+    /* Padding sorts to the end */
+    if (_functional) {
+        uint64_t pad = descending ? 0 : (1ULL << key_bits) - 1;
+        for (uint64_t g = n_keys; g < n; g++)
+            writeValue(key_addr(g, 0), pad, key_bits, true);
+    }
+
+    /* Keys are unsigned integers whatever the system precision is set to */
+    Precision saved_precision = _precision;
+    _precision = Precision::Int32;
+    TimeT start = 0;
+    for (int i = 0; i < _nchips; i++)
+        start = std::max(start, chipTime(i));
+
+    uint64_t steps = 0, remote_steps = 0;
+    vector<uint8_t> take(n, 0);
+    for (uint64_t k = 2; k <= n; k *= 2) {
+        for (uint64_t j = k / 2; j > 0; j /= 2) {
+            bool remote = j >= (uint64_t)_nrows;
+            //------------------------fetch partners------------------------//
+            for (uint64_t g = 0; g < n; g++) {
+                uint64_t b = g / _nrows;
+                Request& req = batchAdd(block_chip(b), block_local(b), 
+                        remote ? Request::Type::SystemRow2Row : Request::Type::RowMv);
+                req.addAddr(key_addr(g ^ j, 0), fw);
+                req.addAddr(key_addr(g, 1), fw);
+            }
+            batchFlush();
+            //------------------------compare------------------------//
+            for (uint64_t g = 0; g < n; g++) {
+                uint64_t b = g / _nrows;
+                batchAdd(block_chip(b), block_local(b), Request::Type::RowSub)
+                    .addAddr(key_addr(g, 0), 2 * fw);
+            }
+            batchFlush();
+            //------------------------read the signs------------------------//
+            for (uint64_t b = 0; b < n_blocks; b++) {
+                Request signs(Request::Type::ColBufferRead);
+                signs.addAddr(key_addr(b * _nrows, 2) + fw - 1, rows);
+                dispatchRequest(signs);
+                for (int r = 0; r < rows; r++) {
+                    uint64_t g = b * _nrows + r;
+                    bool lower = (g & j) == 0;
+                    bool ascending = ((g & k) == 0) != descending;
+                    if (!_functional)
+                        take[g] = !lower;
+                    else if (lower == ascending)
+                        take[g] = !_func_buffer[r];     // wants the smaller key
+                    else
+                        take[g] = _func_buffer[r];      // wants the larger key
+                }
+            }
+            completeRequests();
+            //------------------------swap------------------------//
+            for (uint64_t g = 0; g < n; g++) {
+                if (!take[g])
+                    continue;
+                uint64_t b = g / _nrows;
+                Request& req = batchAdd(block_chip(b), block_local(b), Request::Type::RowMv);
+                req.addAddr(key_addr(g, 1), fw);
+                req.addAddr(key_addr(g, 0), fw);
+            }
+            batchFlush();
+            steps++;
+            remote_steps += remote;
+        }
+    }
+
+    TimeT end = 0;
+    for (int i = 0; i < _nchips; i++)
+        end = std::max(end, chipTime(i));
+
+    /* The host alternative moves every key out through the row buffer and
+     * back in again, the host compute itself not counted */
+    uint64_t keys_per_chip = (n_keys + _nchips - 1) / _nchips;
+    double host_clks = keys_per_chip * (probeCost(Request::Type::RowBufferRead, key_bits)
+                                      + probeCost(Request::Type::RowBufferWrite, key_bits));
+    _precision = saved_precision;
+    fprintf(rstFile, "\n############# Sort ################\n");
+    fprintf(rstFile, "Sorted %lu keys of %d bits (%lu padded), %lu steps, %lu across blocks\n",
+            n_keys, key_bits, n, steps, remote_steps);
+    fprintf(rstFile, "In place: %lu clocks, host round trip: %.0lf clocks\n", end - start, host_clks);
+    return end - start;
+}
+
+/* Analytic estimator
+ *
+ * Requests are decomposed exactly as for simulation (dispatchRequest runs
+ * with _estimating set), but every leaf request reaching issueReq is priced
+ * by a per-type linear model instead of being handed to a chip, and network
+ * hops are charged netLatency(), the same latency the simulation uses.
+ * Within one request, leaves on the same block add up, blocks of a chip
+ * overlap as far as the calibration found they do, and chips run in
+ * parallel; sendRequest waits for every chip, so requests add up. Traces
+ * repeat the same requests a lot, each distinct one is priced once.
+ */
+namespace {
+
+const Request::Type leaf_types[] = {
+    Request::Type::Read, Request::Type::Write,
+    Request::Type::RowMv, Request::Type::ColMv,
+    Request::Type::RowAdd, Request::Type::RowSub, Request::Type::RowMul,
+    Request::Type::RowDiv, Request::Type::RowBitwise, Request::Type::RowSearch,
+    Request::Type::ColAdd, Request::Type::ColSub, Request::Type::ColMul,
+    Request::Type::ColDiv, Request::Type::ColBitwise, Request::Type::ColSearch,
+    Request::Type::RowBufferRead, Request::Type::RowBufferWrite,
+    Request::Type::ColBufferRead, Request::Type::ColBufferWrite,
+};
+
+bool
+isColLeaf(Request::Type type)
+{
+    return type == Request::Type::ColMv || type == Request::Type::ColAdd 
+        || type == Request::Type::ColSub || type == Request::Type::ColMul 
+        || type == Request::Type::ColDiv || type == Request::Type::ColBitwise 
+        || type == Request::Type::ColSearch || type == Request::Type::ColBufferRead 
+        || type == Request::Type::ColBufferWrite;
+}
+
+}
+
+int
+System::estimateNet(int chip1, int chip2, int net_overhead)
+{
+    /* The clocks of both chips meet, the receiver's then runs on by the
+     * transfer; work already queued on them is not waited for */
+    double sync_time = std::max(_est_floor[chip1], _est_floor[chip2]);
+    _est_floor[chip1] = sync_time;
+    _est_floor[chip2] = sync_time + net_overhead;
+    _est_chip[chip1] = std::max(_est_chip[chip1], _est_floor[chip1]);
+    _est_chip[chip2] = std::max(_est_chip[chip2], _est_floor[chip2]);
+    return net_overhead;
+}
+
+void
+System::calibrateLeaf(Request::Type type)
+{
+    /* Microbenchmarks on the idle single-chip copy of this geometry: one
+     * leaf at two sizes, a burst of them on one block and the same burst
+     * spread over as many blocks */
+    const int burst = 4;
+    int sizes[2] = {std::min(8, std::min(_nrows, _ncols) / 2), 
+                    std::min(32, std::min(_nrows, _ncols) / 2)};
+    int n_blocks = std::min(burst, _ntiles * _nblocks);
+    bool col = isColLeaf(type);
+    bool pair = col || type == Request::Type::RowMv;
+    System& probe = probeSystem();
+
+    auto run = [&](int size, int n, bool spread, double& energy) {
+        TimeT t0 = probe.chipTime(0);
+        double e0 = probe.chipEnergy(0);
+        vector<Request> reqs;
+        for (int k = 0; k < n; k++) {
+            int block = spread ? k % n_blocks : 0;
+            int row = spread ? 0 : (col ? 0 : k);
+            int c = spread ? 0 : (col ? k : 0);
+            AddrT addr = probe.getAddress(0, block / _nblocks, block % _nblocks, row, c);
+            if (type == Request::Type::Read || type == Request::Type::Write || reqs.empty())
+                reqs.push_back(Request(type));
+            reqs.back().addAddr(addr, size);
+            if (pair)
+                reqs.back().addAddr(type == Request::Type::RowMv ? addr + size 
+                                  : type == Request::Type::ColMv ? addr + (AddrT)size * _ncols 
+                                  : addr, size);
+        }
+        for (Request& r : reqs)
+            probe.dispatchRequest(r);
+        probe.completeRequests();
+        energy = probe.chipEnergy(0) - e0;
+        return (double)(probe.chipTime(0) - t0);
+    };
+
+    LeafCost cost;
+    double t1[2], tn[2], e1[2], e;
+    for (int i = 0; i < 2; i++) {
+        t1[i] = run(sizes[i], 1, false, e1[i]);
+        tn[i] = run(sizes[i], burst, false, e);
+    }
+    double t_spread = run(sizes[1], burst, true, e);
+    double ds = sizes[1] - sizes[0];
+    double extra0 = (tn[0] - t1[0]) / (burst - 1), extra1 = (tn[1] - t1[1]) / (burst - 1);
+    cost.first_bit = ds > 0 ? (t1[1] - t1[0]) / ds : 0;
+    cost.first = t1[0] - cost.first_bit * sizes[0];
+    cost.extra_bit = ds > 0 ? (extra1 - extra0) / ds : 0;
+    cost.extra = extra0 - cost.extra_bit * sizes[0];
+    cost.energy_bit = ds > 0 ? (e1[1] - e1[0]) / ds : 0;
+    cost.energy = e1[0] - cost.energy_bit * sizes[0];
+    /* Share of a burst that blocks cannot overlap: 1 when the chip
+     * serializes them anyway, 1/n_blocks when they run fully in parallel */
+    cost.share = n_blocks > 1 && tn[1] > 0 ? std::min(1.0, t_spread / tn[1]) : 1.0;
+    _leaf_costs[(int)type] = cost;
+}
+
+void
+System::estimateLeaf(Request& req, int chip_idx, int tile_idx, int block_idx)
+{
+    auto it = _leaf_costs.find((int)req.type);
+    if (it == _leaf_costs.end())
+        return;
+    const LeafCost& cost = it->second;
+    int size = req.size_list.empty() ? 0 : req.size_list[0];
+    int unit = (chip_idx * _ntiles + tile_idx) * _nblocks + block_idx;
+
+    auto blk = _est_block.find(unit);
+    bool first = blk == _est_block.end();
+    double t = first ? cost.first + cost.first_bit * size 
+                     : cost.extra + cost.extra_bit * size;
+    double start = first ? _est_floor[chip_idx] : std::max(blk->second, _est_floor[chip_idx]);
+    double done = start + std::max(t, 0.0);
+    _est_block[unit] = done;
+    _est_serial[chip_idx] += std::max(t, 0.0) * cost.share;
+    _est_chip[chip_idx] = std::max(_est_chip[chip_idx], 
+                                   std::max(done, _est_floor[chip_idx] + _est_serial[chip_idx]));
+    _est_energy += std::max(cost.energy + cost.energy_bit * size, 0.0);
+}
+
+void
+System::calibrateEstimator(const vector<Request>& validation)
+{
+    for (Request::Type type : leaf_types)
+        calibrateLeaf(type);
+
+    /* Error bound: the validation requests are simulated on a fresh copy of
+     * this system and compared with the estimate */
+    _est_cycles_error = 0;
+    _est_energy_error = 0;
+    if (validation.empty())
+        return;
+    DesignPoint point = {_nchips, _ntiles, _nblocks, _nrows, _ncols, _netscheme, "/dev/null"};
+    System sim(_config, point);
+    sim._precision = _precision;
+    for (const Request& r : validation) {
+        Request req = r;
+        sim.sendRequest(req);
+    }
+    double cycles = 0, energy = 0;
+    for (int i = 0; i < _nchips; i++) {
+        cycles = std::max(cycles, (double)sim.chipTime(i));
+        energy += sim.chipEnergy(i);
+    }
+    Estimate est = estimate(validation);
+    if (cycles > 0)
+        _est_cycles_error = fabs(est.cycles - cycles) / cycles;
+    if (energy > 0)
+        _est_energy_error = fabs(est.energy - energy) / energy;
+}
+
+System::Estimate
+System::estimate(const vector<Request>& trace)
+{
+    if (_leaf_costs.empty())
+        calibrateEstimator(vector<Request>());
+    Estimate result = {0, 0, _est_cycles_error, _est_energy_error};
+    bool saved_estimating = _estimating;
+    uint64_t saved_reqs = tot_reqs;
+    _estimating = true;
+    _est_energy = 0;
+    /* Cycles and energy of every distinct request; nothing the estimate
+     * depends on changes while pricing one trace */
+    map<tuple<int, vector<AddrT>, vector<int>>, pair<double, double>> priced;
+    for (const Request& r : trace) {
+        auto key = make_tuple((int)r.type, r.addr_list, r.size_list);
+        auto it = priced.find(key);
+        if (it == priced.end()) {
+            Request req = r;
+            double energy = _est_energy;
+            _est_block.clear();
+            _est_chip.assign(_nchips, 0);
+            _est_floor.assign(_nchips, 0);
+            _est_serial.assign(_nchips, 0);
+            dispatchRequest(req);
+            double cycles = *std::max_element(_est_chip.begin(), _est_chip.end());
+            it = priced.insert(make_pair(key, make_pair(cycles, _est_energy - energy))).first;
+        }
+        result.cycles += it->second.first;
+        result.energy += it->second.second;
+    }
+    _estimating = saved_estimating;
+    tot_reqs = saved_reqs;
+    return result;
+}
+
+void
+System::setMigration(bool enable, double threshold, uint64_t interval)
+{
+    /* threshold is the max/mean load ratio of chips (or of the tiles of
+     * a chip) over one window of interval leaf requests */
+    _migrate = enable;
+    _migrate_threshold = threshold > 1.0 ? threshold : 2.0;
+    _migrate_interval = interval > 0 ? interval : 4096;
+    if (enable && _block_map.empty()) {
+        _block_map.resize((size_t)_nchips * _ntiles * _nblocks);
+        for (size_t i = 0; i < _block_map.size(); i++)
+            _block_map[i] = i;
+    }
+}
+
+void
+System::remapBlock(int& chip_idx, int& tile_idx, int& block_idx)
+{
+    int unit = (chip_idx * _ntiles + tile_idx) * _nblocks + block_idx;
+    int phys = _block_map[unit];
+    if (phys != unit) {
+        block_idx = phys % _nblocks;
+        tile_idx = phys / _nblocks % _ntiles;
+        chip_idx = phys / _nblocks / _ntiles;
+    }
+}
+
+double
+System::loadSpread(const vector<uint64_t>& load, int group, int& hot, int& cold)
+{
+    /* Sums load over groups of consecutive blocks and returns max/mean */
+    int n = load.size() / group;
+    uint64_t tot = 0, max_load = 0, min_load = UINT64_MAX;
+    hot = cold = 0;
+    for (int g = 0; g < n; g++) {
+        uint64_t l = 0;
+        for (int b = 0; b < group; b++)
+            l += load[(size_t)g * group + b];
+        tot += l;
+        if (l > max_load) {
+            max_load = l;
+            hot = g;
+        }
+        if (l < min_load) {
+            min_load = l;
+            cold = g;
+        }
+    }
+    return tot ? (double)max_load * n / tot : 1.0;
+}
+
+void
+System::balanceBlocks()
+{
+    /* Moving one whole block somewhere else only helps if it lowers the
+     * peak: the hottest block of the most loaded chip (or tile, once the
+     * chips are balanced) is swapped with the coldest block of the least
+     * loaded one, provided that the cold side does not end up hotter than
+     * the hot side was. Both blocks are staged row by row in the row
+     * buffers, crossing the network when they sit on different chips, and
+     * written back swapped; the cost is charged to the chips. */
+    int per_chip = _ntiles * _nblocks;
+    /* Window load of a block, chips never built have none */
+    auto window = [&](int unit) -> uint64_t {
+        const vector<uint64_t>& w = _block_window[unit / per_chip];
+        return w.empty() ? 0 : w[unit % per_chip];
+    };
+    vector<uint64_t> chip_load(_nchips, 0), tile_load((size_t)_nchips * _ntiles, 0);
+    for (int c = 0; c < _nchips; c++)
+        for (size_t u = 0; u < _block_window[c].size(); u++) {
+            chip_load[c] += _block_window[c][u];
+            tile_load[(size_t)c * _ntiles + u / _nblocks] += _block_window[c][u];
+        }
+    int hot, cold;
+    double spread = loadSpread(chip_load, 1, hot, cold);
+    int group = per_chip;
+    /* The reported spread is the chip one, the tile one on a single chip */
+    double reported = spread;
+    if (_nchips == 1 || spread < _migrate_threshold) {
+        spread = loadSpread(tile_load, 1, hot, cold);
+        group = _nblocks;
+        if (_nchips == 1)
+            reported = spread;
+    }
+    _spread_last = reported;
+
+    uint64_t hot_load = 0, cold_load = 0;
+    for (int b = 0; b < group; b++) {
+        hot_load += window(hot * group + b);
+        cold_load += window(cold * group + b);
+    }
+    int src = hot * group, dst = cold * group;
+    for (int b = 0; b < group; b++) {
+        if (window(hot * group + b) > window(src))
+            src = hot * group + b;
+        if (window(cold * group + b) < window(dst))
+            dst = cold * group + b;
+    }
+    uint64_t moved = window(src) - window(dst);
+    bool helps = window(src) > window(dst) 
+              && cold_load + moved < hot_load;
+
+    if (spread >= _migrate_threshold && helps) {
+        if (_spread_before < 0)
+            _spread_before = reported;
+        _migrating = true;
+        AddrT a_base = (AddrT)src * _nrows * _ncols, b_base = (AddrT)dst * _nrows * _ncols;
+        Request stage(Request::Type::RowBufferRead), unstage(Request::Type::RowBufferWrite);
+        for (int r = 0; r < _nrows; r++)
+            stage.addAddr(a_base + (AddrT)r * _ncols, _ncols);
+        for (int r = 0; r < _nrows; r++) {
+            stage.addAddr(b_base + (AddrT)r * _ncols, _ncols);
+            unstage.addAddr(b_base + (AddrT)r * _ncols, _ncols);
+        }
+        for (int r = 0; r < _nrows; r++)
+            unstage.addAddr(a_base + (AddrT)r * _ncols, _ncols);
+        TimeT start = 0, end = 0;
+        for (int i = 0; i < _nchips; i++)
+            start = std::max(start, chipTime(i));
+        if (dispatchRequest(stage) < 0) {
+            std::cout << "Wrong Address!" << std::endl;
+            exit(1);
+        }
+        completeRequests();
+        if (src / per_chip != dst / per_chip) {
+            for (int r = 0; r < _nrows; r++) {
+                sendTransfer(a_base + (AddrT)r * _ncols, b_base + (AddrT)r * _ncols, _ncols, true);
+                sendTransfer(b_base + (AddrT)r * _ncols, a_base + (AddrT)r * _ncols, _ncols, true);
+            }
+        }
+        if (dispatchRequest(unstage) < 0) {
+            std::cout << "Wrong Address!" << std::endl;
+            exit(1);
+        }
+        completeRequests();
+        for (int i = 0; i < _nchips; i++)
+            end = std::max(end, chipTime(i));
+        _migrate_clks += end - start;
+        _migrating = false;
+        /* The logical blocks living at src and dst trade places */
+        for (size_t i = 0; i < _block_map.size(); i++) {
+            if (_block_map[i] == src)
+                _block_map[i] = dst;
+            else if (_block_map[i] == dst)
+                _block_map[i] = src;
+        }
+        _migrations++;
+    }
+    for (vector<uint64_t>& w : _block_window)
+        std::fill(w.begin(), w.end(), 0);
+    _window_ops = 0;
+}
+
+void
+System::reportMigration()
+{
+    if (!_migrate)
+        return;
+    fprintf(rstFile, "\n############# Utilization ##########\n");
+    uint64_t tot_ops = 0, max_ops = 0, busy_blocks = 0;
+    uint64_t n_blocks = (uint64_t)_nchips * _ntiles * _nblocks;
+    for (const vector<uint64_t>& chip_ops : _block_ops)
+        for (uint64_t ops : chip_ops) {
+            tot_ops += ops;
+            max_ops = std::max(max_ops, ops);
+            busy_blocks += ops > 0;
+        }
+    fprintf(rstFile, "Block requests: %lu total, %lu on the busiest block, %lu of %lu blocks idle\n",
+            tot_ops, max_ops, n_blocks - busy_blocks, n_blocks);
+    if (tot_ops > 0)
+        fprintf(rstFile, "Block load spread (max/mean): %.2lf\n", 
+                (double)max_ops * n_blocks / tot_ops);
+    fprintf(rstFile, "Migrations: %lu, %lu clocks spent moving blocks\n", 
+            _migrations, _migrate_clks);
+    if (_spread_before >= 0)
+        fprintf(rstFile, "Load spread before the first migration: %.2lf, last window: %.2lf\n",
+                _spread_before, _spread_last);
+}
+
+namespace {
+
+/* Smallest and largest of n clocks */
+void
+clockRange(const TimeT* clk, size_t n, TimeT& lo, TimeT& hi)
+{
+    size_t i = 0;
+    lo = ~(TimeT)0;
+    hi = 0;
+#if defined(__AVX512F__)
+    __m512i vlo = _mm512_set1_epi64(-1), vhi = _mm512_setzero_si512();
+    for (; i + 8 <= n; i += 8) {
+        __m512i v = _mm512_loadu_si512(clk + i);
+        vlo = _mm512_min_epu64(vlo, v);
+        vhi = _mm512_max_epu64(vhi, v);
+    }
+    lo = _mm512_reduce_min_epu64(vlo);
+    hi = _mm512_reduce_max_epu64(vhi);
+#elif defined(__AVX2__)
+    /* No unsigned 64-bit compare: flip the sign bit and compare signed */
+    const __m256i bias = _mm256_set1_epi64x((long long)(1ULL << 63));
+    __m256i vlo = _mm256_set1_epi64x(0x7fffffffffffffffLL), vhi = bias;
+    for (; i + 4 <= n; i += 4) {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(clk + i)), bias);
+        vlo = _mm256_blendv_epi8(vlo, v, _mm256_cmpgt_epi64(vlo, v));
+        vhi = _mm256_blendv_epi8(vhi, v, _mm256_cmpgt_epi64(v, vhi));
+    }
+    alignas(32) uint64_t l[4], h[4];
+    _mm256_store_si256((__m256i*)l, _mm256_xor_si256(vlo, bias));
+    _mm256_store_si256((__m256i*)h, _mm256_xor_si256(vhi, bias));
+    for (int k = 0; k < 4; k++) {
+        lo = std::min<TimeT>(lo, l[k]);
+        hi = std::max<TimeT>(hi, h[k]);
+    }
+#endif
+    for (; i < n; i++) {
+        lo = std::min(lo, clk[i]);
+        hi = std::max(hi, clk[i]);
+    }
+}
+
+}
+
+void
+System::syncSet(const vector<uint64_t>& set)
+{
+    /* Refresh the clock mirror of the built chips, then reduce. The clocks
+     * of a subset are gathered first, so it reduces the same way. */
+    bool all = set == _all_chips;
+    _sync_clocks.clear();
+    for (size_t w = 0; w < set.size(); w++)
+        for (uint64_t m = set[w]; m; m &= m - 1) {
+            int i = w * 64 + __builtin_ctzll(m);
+            if (_chips[i])
+                _chip_clock[i] = _chips[i]->getTime();
+            if (!all)
+                _sync_clocks.push_back(_chip_clock[i]);
+        }
+    TimeT lo, hi;
+    if (all)
+        clockRange(_chip_clock.data(), _chip_clock.size(), lo, hi);
+    else
+        clockRange(_sync_clocks.data(), _sync_clocks.size(), lo, hi);
+
+    for (size_t w = 0; w < set.size(); w++)
+        for (uint64_t m = set[w]; m; m &= m - 1) {
+            int i = w * 64 + __builtin_ctzll(m);
+            if (!_chips[i]) {
+                _chip_clock[i] = hi;
+                continue;
+            }
+            /* Already in step when the whole set is */
+            if (lo < hi)
+                advanceChip(i, hi);
+            _chips[i]->updateTime();
+        }
+}
+
+namespace {
+
+/* Bits per cycle of a chip network link unless the scheme says otherwise */
+const int default_link_bw = 64;
+
+}
+
+bool
+System::buildNetTable()
+{
+    /* _netscheme is "<kind>[:key=value]...", colon separated so that it
+     * survives the comma lists of parseSweep, e.g.
+     *   torus:dims=16x16:hop_lat=4:link_bw=64
+     *   fattree:radix=16:hop_lat=2:link_bw=128
+     *   hier:board=8:rack=4:board_lat=2:rack_lat=8:sys_lat=32
+     * Latencies are in chip cycles per hop, bandwidths in bits per cycle.
+     * Every chip pair gets its hop count, the summed link latency and the
+     * narrowest link on its path, so netLatency is a lookup. */
+    _net_hops.clear();
+    _net_base.clear();
+    _net_bw.clear();
+    vector<string> fields;
+    istringstream in(_netscheme);
+    string f;
+    while (getline(in, f, ':'))
+        fields.push_back(f);
+    if (fields.empty())
+        return false;
+    const string& kind = fields[0];
+    if (kind != "torus" && kind != "fattree" && kind != "hier")
+        return false;
+
+    map<string, int> par = {
+        {"hop_lat", 4}, {"link_bw", default_link_bw}, {"radix", 16}, {"dimx", 0}, {"dimy", 0},
+        {"board", 8}, {"rack", 4}, 
+        {"board_lat", 2}, {"board_bw", 256}, {"rack_lat", 8}, {"rack_bw", 128},
+        {"sys_lat", 32}, {"sys_bw", 64},
+    };
+    for (size_t i = 1; i < fields.size(); i++) {
+        size_t eq = fields[i].find('=');
+        string key = fields[i].substr(0, eq);
+        string val = eq == string::npos ? "" : fields[i].substr(eq + 1);
+        if (key == "dims") {
+            size_t x = val.find('x');
+            par["dimx"] = atoi(val.substr(0, x).c_str());
+            par["dimy"] = x == string::npos ? 1 : atoi(val.substr(x + 1).c_str());
+        } else if (par.count(key) && eq != string::npos) {
+            par[key] = atoi(val.c_str());
+        } else {
+            cout << "[Error] unknown network parameter: " << fields[i] << endl;
+        }
+    }
+    for (auto& kv : par)
+        if (kv.first.compare(0, 3, "dim") && kv.second < 1)
+            kv.second = 1;
+
+    int n = _nchips;
+    _net_hops.assign((size_t)n * n, 0);
+    _net_base.assign((size_t)n * n, 0);
+    _net_bw.assign((size_t)n * n, 0);
+    char desc[128];
+    if (kind == "torus") {
+        int dx = par["dimx"], dy = par["dimy"];
+        if (dx < 1 || dy < 1 || dx * dy < n) {
+            /* Squarest grid that holds every chip exactly */
+            dx = (int)sqrt((double)n);
+            while (dx > 1 && n % dx)
+                dx--;
+            dy = (n + dx - 1) / dx;
+        }
+        snprintf(desc, sizeof(desc), "torus %dx%d", dx, dy);
+        for (int a = 0; a < n; a++)
+            for (int b = 0; b < n; b++) {
+                int x = abs(a % dx - b % dx), y = abs(a / dx - b / dx);
+                int hops = std::min(x, dx - x) + std::min(y, dy - y);
+                size_t k = (size_t)a * n + b;
+                _net_hops[k] = hops;
+                _net_base[k] = hops * par["hop_lat"];
+                _net_bw[k] = par["link_bw"];
+            }
+    } else if (kind == "fattree") {
+        /* Half of every switch's ports go down: d chips per leaf switch,
+         * d leaf switches per next level and so on */
+        int d = std::max(2, par["radix"] / 2);
+        int levels = 0;
+        for (long span = 1; span < n; span *= d)
+            levels++;
+        snprintf(desc, sizeof(desc), "fat-tree radix %d, %d levels", 2 * d, levels);
+        for (int a = 0; a < n; a++)
+            for (int b = 0; b < n; b++) {
+                int up = 0;
+                for (long span = 1; a / span != b / span; span *= d)
+                    up++;
+                size_t k = (size_t)a * n + b;
+                _net_hops[k] = 2 * up;
+                _net_base[k] = 2 * up * par["hop_lat"];
+                _net_bw[k] = par["link_bw"];
+            }
+    } else {
+        int board = par["board"], rack = par["rack"] * board;
+        snprintf(desc, sizeof(desc), "hierarchical, %d chips per board, %d per rack", 
+                 board, rack);
+        for (int a = 0; a < n; a++)
+            for (int b = 0; b < n; b++) {
+                size_t k = (size_t)a * n + b;
+                if (a == b)
+                    continue;
+                /* Up to the lowest common switch and back down */
+                int hops = 2, base = 2 * par["board_lat"], bw = par["board_bw"];
+                if (a / board != b / board) {
+                    hops += 2;
+                    base += 2 * par["rack_lat"];
+                    bw = std::min(bw, par["rack_bw"]);
+                }
+                if (a / rack != b / rack) {
+                    hops += 2;
+                    base += 2 * par["sys_lat"];
+                    bw = std::min(bw, par["sys_bw"]);
+                }
+                _net_hops[k] = hops;
+                _net_base[k] = base;
+                _net_bw[k] = bw;
+            }
+    }
+    _net_desc = desc;
+    return true;
+}
+
+int
+System::netLatency(int chip1, int chip2, int size)
+{
+    if (_net_hops.empty())
+        return _conn->getLatency(chip1, chip2, size);
+    size_t k = (size_t)chip1 * _nchips + chip2;
+    if (chip1 == chip2)
+        return 0;
+    /* Head latency plus serialization on the narrowest link */
+    return _net_base[k] + (size + _net_bw[k] - 1) / _net_bw[k];
+}
+
+void
+System::reportTopology()
+{
+    if (_net_hops.empty())
+        return;
+    uint64_t hop_sum = 0;
+    int diameter = 0;
+    for (uint16_t h : _net_hops) {
+        hop_sum += h;
+        diameter = std::max(diameter, (int)h);
+    }
+    int n = _nchips;
+    fprintf(rstFile, "Topology: %s, diameter %d hops, %.2lf hops on average\n",
+            _net_desc.c_str(), diameter, 
+            n > 1 ? (double)hop_sum / ((double)n * (n - 1)) : 0.0);
+}
+
+#if defined(__cpp_impl_coroutine)
+/* Coroutine kernels
+ *
+ * A kernel is a coroutine returning System::Kernel that co_awaits
+ * submit(req) or flush() where a blocking kernel would call sendRequest.
+ * spawn() hands kernels to the system, run() drives all of them on the
+ * calling thread in rounds: every ready kernel runs up to its next await,
+ * which only admits its request to the chips, then one completeRequests()
+ * waits for everything in flight and the waiting kernels resume. Phases of
+ * independent kernels thus share the chips the way batchFlush() shares
+ * them between blocks, without the kernels knowing about each other.
+ */
+void
+System::RequestAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    if (has_req) {
+        int saved_tenant = sys->_cur_tenant;
+        if (tenant >= 0) {
+            if (!sys->translateRequest(tenant, req)) {
+                std::cout << "Wrong Address!" << std::endl;
+                exit(1);
+            }
+            sys->_cur_tenant = tenant;
+            issued = sys->systemTime();
+        }
+        sys->dispatchRequest(req);
+        sys->_cur_tenant = saved_tenant;
+        sys->_kernel_reqs++;
+    }
+    sys->_kernels_waiting.push_back(h);
+}
+
+bool
+System::RequestAwaiter::await_resume()
+{
+    if (has_req && tenant >= 0)
+        sys->tenantDone(tenant, issued);
+    return !rejected;
+}
+
+System::RequestAwaiter
+System::submit(const Request& req)
+{
+    return RequestAwaiter{this, req, true};
+}
+
+System::RequestAwaiter
+System::submit(int tenant, const Request& req)
+{
+    if (tenant < 0 || tenant >= (int)_tenants.size()) {
+        cout << "[Error] unknown tenant #" << tenant << "!\n";
+        return RequestAwaiter{this, req, false, -1, 0, true};
+    }
+    return RequestAwaiter{this, req, true, tenant};
+}
+
+System::RequestAwaiter
+System::flush()
+{
+    /* Waits for the requests in flight without adding one */
+    return RequestAwaiter{this, Request(Request::Type::Read), false};
+}
+
+void
+System::spawn(Kernel kernel)
+{
+    _kernels.push_back(kernel.handle);
+    _kernels_ready.push_back(kernel.handle);
+    kernel.handle = nullptr;
+}
+
+void
+System::run()
+{
+    TimeT start = 0;
+    for (int i = 0; i < _nchips; i++)
+        start = std::max(start, chipTime(i));
+    uint64_t n_kernels = _kernels.size(), rounds = _kernel_rounds, reqs = _kernel_reqs;
+
+    while (!_kernels_ready.empty()) {
+        while (!_kernels_ready.empty()) {
+            std::coroutine_handle<> h = _kernels_ready.front();
+            _kernels_ready.pop_front();
+            h.resume();
+        }
+        /* Kernels that neither finished nor awaited cannot exist, so the
+         * waiting list holds every live kernel here */
+        if (_kernels_waiting.empty())
+            break;
+        completeRequests();
+        _kernel_rounds++;
+        for (auto h : _kernels_waiting)
+            _kernels_ready.push_back(h);
+        _kernels_waiting.clear();
+    }
+    for (auto h : _kernels)
+        h.destroy();
+    _kernels.clear();
+
+    TimeT end = 0;
+    for (int i = 0; i < _nchips; i++)
+        end = std::max(end, chipTime(i));
+    fprintf(rstFile, "\n############# Kernels #############\n");
+    fprintf(rstFile, "%lu kernels, %lu requests in %lu rounds, %lu clocks\n",
+            n_kernels, _kernel_reqs - reqs, _kernel_rounds - rounds, end - start);
+}
+
+namespace {
+
+/* Looks up key in n_blocks blocks of records, one block per round */
+System::Kernel
+searchKernel(System& sys, AddrT base, int n_blocks, int rows, AddrT block_size)
+{
+    for (int b = 0; b < n_blocks; b++) {
+        Request search(Request::Type::RowSearch);
+        for (int r = 0; r < rows; r++)
+            search.addAddr(base + b * block_size + (AddrT)r * (block_size / rows), 2 * 32);
+        co_await sys.submit(search);
+    }
+}
+
+/* Multiply-accumulate over the rows of one block */
+System::Kernel
+macKernel(System& sys, AddrT base, int rows, int ncols, int steps)
+{
+    for (int i = 0; i < steps; i++) {
+        Request mul(Request::Type::RowMul);
+        for (int r = 0; r < rows; r++)
+            mul.addAddr(base + (AddrT)r * ncols, 2 * 32);
+        co_await sys.submit(mul);
+        Request add(Request::Type::ColAdd);
+        add.addAddr(base + 64, 2 * 32);
+        add.addAddr(base + 64, 2 * 32);
+        co_await sys.submit(add);
+    }
+}
+
+}
+
+void System::example_3() {
+    // A search over the first blocks of chip 0 and a multiply-accumulate
+    // loop in the block after them, run side by side
+    AddrT block_size = (AddrT)_nrows * _ncols;
+    int n_blocks = std::min(4, _ntiles * _nblocks - 1);
+    spawn(searchKernel(*this, 0, n_blocks, std::min(_nrows, 64), block_size));
+    spawn(macKernel(*this, n_blocks * block_size, std::min(_nrows, 64), _ncols, n_blocks));
+    run();
+}
+#endif
+
+int
+System::addTenant(const string& name, int first_chip, int n_chips,
+                  int first_block, int n_blocks, double weight, bool priority)
+{
+    /* A tenant owns n_blocks consecutive blocks (numbered tile by tile)
+     * on each of n_chips consecutive chips and sees them as a system of
+     * its own, see tenantAddress(). Partitions may not overlap. weight and
+     * priority arbitrate the network ports in every mode, but the chip
+     * controllers only when they are hierarchical: the flat controller
+     * admits requests in the order the host sends them, so there is no
+     * choice between tenants for it to make. */
+    int per_chip = _ntiles * _nblocks;
+    if (first_chip < 0 || n_chips <= 0 || first_chip + n_chips > _nchips
+            || first_block < 0 || n_blocks <= 0 || first_block + n_blocks > per_chip
+            || weight <= 0) {
+        cout << "[Error] tenant " << name << " does not fit the system" << endl;
+        return -1;
+    }
+    for (const Tenant& t : _tenants) {
+        bool chips = first_chip < t.first_chip + t.n_chips && t.first_chip < first_chip + n_chips;
+        bool blocks = first_block < t.first_block + t.n_blocks && t.first_block < first_block + n_blocks;
+        if (chips && blocks) {
+            cout << "[Error] tenant " << name << " overlaps tenant " << t.name << endl;
+            return -1;
+        }
+    }
+    Tenant t;
+    t.name = name;
+    t.first_chip = first_chip;
+    t.n_chips = n_chips;
+    t.first_block = first_block;
+    t.n_blocks = n_blocks;
+    t.weight = weight;
+    t.priority = priority;
+    t.reqs = 0;
+    t.served = 0;
+    t.net_clks = 0;
+    t.first_issue = 0;
+    t.last_done = 0;
+    _tenants.push_back(t);
+    _port_busy.assign(_nchips, 0);
+    _port_usage.assign((size_t)_nchips * _tenants.size(), 0.0);
+    return _tenants.size() - 1;
+}
+
+AddrT
+System::tenantAddress(int tenant, int chip, int block, int row, int col)
+{
+    const Tenant& t = _tenants[tenant];
+    return (((AddrT)chip * t.n_blocks + block) * _nrows + row) * _ncols + col;
+}
+
+bool
+System::translateRequest(int tenant, Request& req)
+{
+    /* Tenant addresses to system addresses, false if one falls outside
+     * the tenant's partition */
+    const Tenant& t = _tenants[tenant];
+    for (AddrT& addr : req.addr_list) {
+        AddrT a = addr;
+        int col = a % _ncols;
+        a /= _ncols;
+        int row = a % _nrows;
+        a /= _nrows;
+        int block = a % t.n_blocks;
+        AddrT chip = a / t.n_blocks;
+        if (chip >= (AddrT)t.n_chips)
+            return false;
+        int unit = t.first_block + block;
+        addr = getAddress(t.first_chip + chip, unit / _nblocks, unit % _nblocks, row, col);
+    }
+    return true;
+}
+
+TimeT
+System::systemTime()
+{
+    TimeT now = 0;
+    for (int i = 0; i < _nchips; i++)
+        now = std::max(now, chipTime(i));
+    return now;
+}
+
+int
+System::sendRequest(int tenant, Request& req)
+{
+    /* Blocking request on behalf of a tenant, its latency is the time
+     * until every chip has completed it */
+    if (tenant < 0 || tenant >= (int)_tenants.size()) {
+        cout << "[Error] unknown tenant #" << tenant << "!\n";
+        return -1;
+    }
+    Request sys_req = req;
+    if (!translateRequest(tenant, sys_req)) {
+        std::cout << "Wrong Address!" << std::endl;
+        exit(1);
+    }
+    int saved_tenant = _cur_tenant;
+    _cur_tenant = tenant;
+    TimeT issued = systemTime();
+    int ticks = dispatchRequest(sys_req);
+    completeRequests();
+    _cur_tenant = saved_tenant;
+    tenantDone(tenant, issued);
+    return ticks;
+}
+
+void
+System::tenantDone(int tenant, TimeT issued)
+{
+    Tenant& t = _tenants[tenant];
+    TimeT now = systemTime();
+    if (t.reqs == 0 || issued < t.first_issue)
+        t.first_issue = issued;
+    t.last_done = std::max(t.last_done, now);
+    t.reqs++;
+    t.latency.push_back(now - issued);
+}
+
+int
+System::netSerialize(int chip1, int chip2, int size)
+{
+    /* Cycles a transfer occupies the ports: its size over the narrowest
+     * link width on the path. The GlobalConnection models do not expose
+     * their widths, they are charged at the default link width. */
+    if (chip1 == chip2)
+        return 0;
+    int bw = _net_bw.empty() ? default_link_bw : _net_bw[(size_t)chip1 * _nchips + chip2];
+    return (size + bw - 1) / bw;
+}
+
+int
+System::arbitrateNet(int chip1, int chip2, TimeT now, int serialize)
+{
+    /* Chip network ports are shared by the tenants. A transfer waits for
+     * both ports unless its tenant has latency priority or has used less
+     * of them, relative to its weight, than every other tenant that uses
+     * them (weighted fair share). The ports are then held for the
+     * transfer's serialization time. Returns the cycles waited. */
+    int n = _tenants.size();
+    const Tenant& t = _tenants[_cur_tenant];
+    bool go = t.priority;
+    if (!go) {
+        go = true;
+        for (int port : {chip1, chip2}) {
+            double mine = _port_usage[(size_t)port * n + _cur_tenant] / t.weight;
+            for (int u = 0; u < n && go; u++) {
+                double used = _port_usage[(size_t)port * n + u];
+                if (u != _cur_tenant && used > 0 && used / _tenants[u].weight < mine)
+                    go = false;
+            }
+        }
+    }
+    TimeT start = now;
+    if (!go)
+        start = std::max(start, std::max(_port_busy[chip1], _port_busy[chip2]));
+    for (int port : {chip1, chip2}) {
+        _port_busy[port] = std::max(_port_busy[port], start) + serialize;
+        _port_usage[(size_t)port * n + _cur_tenant] += serialize;
+    }
+    int wait = start - now;
+    _tenants[_cur_tenant].net_clks += wait + serialize;
+    return wait;
+}
+
+void
+System::reportTenants()
+{
+    if (_tenants.empty())
+        return;
+    fprintf(rstFile, "\n############# Tenants #############\n");
+    if (!_hierctrl)
+        fprintf(rstFile, "Flat chip controller: tenants share the network ports only\n");
+    for (Tenant& t : _tenants) {
+        fprintf(rstFile, "Tenant %s: chips %d-%d, blocks %d-%d, weight %.2lf%s\n",
+                t.name.c_str(), t.first_chip, t.first_chip + t.n_chips - 1,
+                t.first_block, t.first_block + t.n_blocks - 1, t.weight,
+                t.priority ? ", latency priority" : "");
+        TimeT span = t.last_done - t.first_issue;
+        double seconds = span * 1e-6 / _clock_rate;
+        fprintf(rstFile, "  %lu requests, %.4e requests/s, %lu controller issues, %lu network clocks\n",
+                t.reqs, seconds > 0 ? t.reqs / seconds : 0.0, t.served, t.net_clks);
+        if (!t.latency.empty()) {
+            vector<TimeT> lat(t.latency);
+            std::sort(lat.begin(), lat.end());
+            fprintf(rstFile, "  latency p50 %lu, p99 %lu, max %lu clocks\n",
+                    lat[(lat.size() - 1) / 2], lat[(lat.size() - 1) * 99 / 100], lat.back());
+        }
+    }
+}
+
+void
+System::locate(const Request& req, const Location* locs, int i,
+               int& chip_idx, int& tile_idx, int& block_idx, int& row_idx, int& col_idx)
+{
+    /* Address i of req, taken from a compiled program when there is one */
+    if (locs) {
+        const Location& loc = locs[i];
+        chip_idx = loc.chip;
+        tile_idx = loc.tile;
+        block_idx = loc.block;
+        row_idx = loc.row;
+        col_idx = loc.col;
+        return;
+    }
+    getLocation(req.addr_list[i], chip_idx, tile_idx, block_idx, row_idx, col_idx);
+}
+
+bool
+System::compile(const vector<Request>& trace, Program& prog, int tenant)
+{
+    /* Decodes and checks a whole request stream before anything runs.
+     * Every address is decoded once into prog.locs, in the order of the
+     * request's addr_list, and checked against the geometry the same way
+     * the send functions would check it at run time, plus addresses past
+     * the end of the system (which getLocation would silently wrap).
+     * Returns false, with the first problem printed, if any request would
+     * stop the simulation. A program compiled for a tenant holds tenant
+     * addresses, they are translated here once and runProgram accounts
+     * the requests to the tenant. */
+    prog.reqs.clear();
+    prog.locs.clear();
+    prog.first.clear();
+    prog.tenant = tenant;
+    prog.migrations = _migrations;
+    if (tenant >= (int)_tenants.size()) {
+        cout << "[Error] no tenant #" << tenant << endl;
+        return false;
+    }
+    AddrT capacity = (AddrT)_nchips * _ntiles * _nblocks * _nrows * _ncols;
+    for (size_t k = 0; k < trace.size(); k++) {
+        Request req = trace[k];
+        size_t first = prog.locs.size();
+        size_t n = req.addr_list.size();
+        const char* error = NULL;
+        if (tenant >= 0 && !translateRequest(tenant, req))
+            error = "address outside the tenant's partition";
+        for (size_t i = 0; i < n && !error; i++) {
+            if (req.addr_list[i] >= capacity) {
+                error = "address beyond the system";
+                break;
+            }
+            Location loc;
+            getLocation(req.addr_list[i], loc.chip, loc.tile, loc.block, loc.row, loc.col);
+            prog.locs.push_back(loc);
+        }
+
+        /* Row- or column-direction extent of address i */
+        auto fits = [&](size_t i, bool along_row) {
+            const Location& loc = prog.locs[first + i];
+            return along_row ? loc.col + req.size_list[i] <= _ncols 
+                             : loc.row + req.size_list[i] <= _nrows;
+        };
+        bool pairs = false;
+        bool src_row = true, dst_row = true;
+        switch (req.type) {
+            case Request::Type::Read:
+            case Request::Type::Write:
+            case Request::Type::RowAdd:
+            case Request::Type::RowSub:
+            case Request::Type::RowMul:
+            case Request::Type::RowDiv:
+            case Request::Type::RowBitwise:
+            case Request::Type::RowSearch:
+                if (n == 0 && !error)
+                    error = "no address";
+                break;
+            case Request::Type::ColAdd:
+            case Request::Type::ColSub:
+            case Request::Type::ColMul:
+            case Request::Type::ColDiv:
+            case Request::Type::ColBitwise:
+            case Request::Type::ColSearch:
+                pairs = true;
+                break;
+            case Request::Type::RowBufferRead:
+            case Request::Type::RowBufferWrite:
+            case Request::Type::ColBufferRead:
+            case Request::Type::ColBufferWrite: {
+                bool row = req.type == Request::Type::RowBufferRead 
+                        || req.type == Request::Type::RowBufferWrite;
+                for (size_t i = 0; i < n && !error; i++)
+                    if (!fits(i, row))
+                        error = "buffer access runs off the block";
+                break;
+            }
+            case Request::Type::RowMv:
+            case Request::Type::ColMv: {
+                pairs = true;
+                bool row = req.type == Request::Type::RowMv;
+                for (size_t i = 0; i + 1 < n && !error; i += 2) {
+                    const Location& src = prog.locs[first + i];
+                    const Location& dst = prog.locs[first + i + 1];
+                    if (src.chip != dst.chip || src.block != dst.block 
+                            || (row && src.tile != dst.tile))
+                        error = "move between blocks";
+                    else if (!fits(i, row) || !fits(i + 1, row))
+                        error = "move runs off the block";
+                }
+                break;
+            }
+            case Request::Type::NetworkSend:
+            case Request::Type::NetworkReceive:
+                if (n < 2 && !error)
+                    error = "network request needs source and destination";
+                break;
+            case Request::Type::SystemRow2Col:
+                dst_row = false;
+                pairs = true;
+                break;
+            case Request::Type::SystemCol2Row:
+                src_row = false;
+                pairs = true;
+                break;
+            case Request::Type::SystemCol2Col:
+                src_row = dst_row = false;
+                pairs = true;
+                break;
+            case Request::Type::SystemRow2Row:
+                pairs = true;
+                break;
+            default:
+                error = "unrecognized request";
+                break;
+        }
+        if (!error && pairs && n % 2)
+            error = "odd number of addresses";
+        bool transfer = req.type == Request::Type::SystemRow2Row 
+                     || req.type == Request::Type::SystemRow2Col
+                     || req.type == Request::Type::SystemCol2Row 
+                     || req.type == Request::Type::SystemCol2Col;
+        for (size_t i = 0; transfer && i + 1 < n && !error; i += 2)
+            if (!fits(i, src_row) || !fits(i + 1, dst_row))
+                error = "transfer runs off the block";
+
+        if (error) {
+            Request bad = trace[k];
+            cout << "[Error] request #" << k << " (" << bad.reqToStr() << "): " 
+                 << error << endl;
+            prog.locs.resize(first);
+            return false;
+        }
+        prog.reqs.push_back(req);
+        prog.first.push_back(first);
+    }
+    return true;
+}
+
+int
+System::runProgram(Program& prog)
+{
+    /* Replays a compiled program. The decoded locations are used as they
+     * are unless a migration has moved blocks since the program was
+     * compiled, in which case the addresses go through getLocation again.
+     * Requests of a tenant's program are scheduled and accounted like
+     * sendRequest(tenant, req) does. */
+    int ticks = 0;
+    bool decoded = prog.migrations == _migrations;
+    int saved_tenant = _cur_tenant;
+    _cur_tenant = prog.tenant;
+    /* Without a target of its own the live stats count down this program */
+    _live_goal = tot_reqs + prog.reqs.size();
+    for (size_t k = 0; k < prog.reqs.size(); k++) {
+        TimeT issued = prog.tenant >= 0 ? systemTime() : 0;
+        ticks += dispatchRequest(prog.reqs[k], decoded ? &prog.locs[prog.first[k]] : NULL);
+        completeRequests();
+        if (prog.tenant >= 0)
+            tenantDone(prog.tenant, issued);
+        decoded = decoded && prog.migrations == _migrations;
+    }
+    _cur_tenant = saved_tenant;
+    return ticks;
+}
+
+namespace {
+
+/* Element k of a bit vector holding w-bit values, LSB first */
+uint64_t
+bitsElem(const vector<uint8_t>& bits, size_t k, int w)
+{
+    uint64_t v = 0;
+    for (int j = 0; j < w && k * w + j < bits.size(); j++)
+        v |= (uint64_t)bits[k * w + j] << j;
+    return v;
+}
+
+/* Encoded size in bits of a transfer under each scheme */
+uint64_t
+compressedBits(System::Compression scheme, const vector<uint8_t>& bits, int w)
+{
+    size_t n = (bits.size() + w - 1) / w;
+    uint64_t out = 0;
+    switch (scheme) {
+        case System::Compression::ZeroRun: {
+            /* Flag bit per token: a run of up to 256 zero elements in 8
+             * bits, or one literal element */
+            size_t run = 0;
+            for (size_t k = 0; k < n; k++) {
+                if (bitsElem(bits, k, w) == 0) {
+                    if (run++ % 256 == 0)
+                        out += 1 + 8;
+                } else {
+                    run = 0;
+                    out += 1 + w;
+                }
+            }
+            break;
+        }
+        case System::Compression::BitPlane: {
+            /* Bit j of every element forms plane j, all-zero planes are
+             * sent as a single flag bit */
+            for (int j = 0; j < w; j++) {
+                bool zero = true;
+                for (size_t k = 0; k < n && zero; k++)
+                    zero = k * w + j >= bits.size() || !bits[k * w + j];
+                out += zero ? 1 : 1 + n;
+            }
+            break;
+        }
+        case System::Compression::BaseDelta: {
+            /* Groups of 8: a 5-bit delta width, the first element as base
+             * and the signed deltas of the others */
+            for (size_t g = 0; g < n; g += 8) {
+                size_t len = std::min<size_t>(8, n - g);
+                int64_t base = bitsElem(bits, g, w);
+                int dw = 0;
+                for (size_t k = 1; k < len; k++) {
+                    int64_t d = (int64_t)bitsElem(bits, g + k, w) - base;
+                    uint64_t mag = d < 0 ? ~(uint64_t)d : (uint64_t)d;
+                    int need = 1;
+                    while (mag) {
+                        need++;
+                        mag >>= 1;
+                    }
+                    if (d != 0)
+                        dw = std::max(dw, need);
+                }
+                out += 5 + w + (len - 1) * dw;
+            }
+            break;
+        }
+        default:
+            out = bits.size();
+            break;
+    }
+    return out;
+}
+
+const char*
+compressionName(System::Compression scheme)
+{
+    switch (scheme) {
+        case System::Compression::ZeroRun: return "zero-run";
+        case System::Compression::BitPlane: return "bit-plane";
+        case System::Compression::BaseDelta: return "base-delta";
+        default: return "none";
+    }
+}
+
+}
+
+void
+System::setCompression(Compression scheme, int bits_per_cycle)
+{
+    /* bits_per_cycle is the throughput of the encoder and of the decoder
+     * on every chip */
+    _compress = scheme;
+    _compress_rate = bits_per_cycle > 0 ? bits_per_cycle : 64;
+}
+
+void
+System::setCompressionRatio(AddrT first, AddrT last, double ratio)
+{
+    /* Ratio (raw / compressed) assumed for transfers out of [first, last]
+     * when there is no functional data to measure; later regions win */
+    if (ratio <= 0)
+        return;
+    CompressRegion region = {first, last, ratio};
+    _compress_regions.push_back(region);
+}
+
+int
+System::sendTransfer(AddrT src_addr, AddrT dst_addr, int size, bool src_row,
+                     const vector<uint8_t>* data)
+{
+    /* One cross-chip hop of size bits, from the chip of src_addr to the
+     * chip of dst_addr. With compression on, the source chip encodes the
+     * data first, only the encoded bits cross the network and the
+     * destination decodes them; data that does not shrink is sent raw.
+     * In functional mode the encoder has to run to find out, so its
+     * cycles are paid either way. Without data, a region whose assumed
+     * ratio is at most 1 is known not to shrink and is not encoded. */
+    int wire = size, enc = 0, dec = 0;
+    int cp1, tl1, bk1, r1, c1, cp2, tl2, bk2, r2, c2;
+    getLocation(src_addr, cp1, tl1, bk1, r1, c1);
+    getLocation(dst_addr, cp2, tl2, bk2, r2, c2);
+    if (_compress != Compression::None && size > 0) {
+        uint64_t packed = size;
+        bool encode = true;
+        if (_functional) {
+            vector<uint8_t> bits;
+            if (!data) {
+                funcRead(src_addr, src_row, size, bits);
+                data = &bits;
+            }
+            packed = compressedBits(_compress, *data, precisionBits(_precision));
+        } else {
+            double ratio = 1.0;
+            for (const CompressRegion& r : _compress_regions)
+                if (src_addr >= r.first && src_addr <= r.last)
+                    ratio = r.ratio;
+            encode = ratio > 1.0;
+            packed = encode ? (uint64_t)ceil(size / ratio) : size;
+        }
+        if (encode)
+            enc = (size + _compress_rate - 1) / _compress_rate;
+        if (packed < (uint64_t)size) {
+            wire = packed;
+            dec = enc;
+            _compress_used++;
+        }
+        _compress_xfers++;
+        _compress_raw += size;
+        _compress_wire += wire;
+        _compress_enc += enc;
+        _compress_dec += dec;
+    }
+
+    int tot_clks = 0;
+    if (enc > 0) {
+        if (_estimating) {
+            _est_floor[cp1] += enc;
+            _est_chip[cp1] = std::max(_est_chip[cp1], _est_floor[cp1]);
+        } else {
+            tot_clks += advanceChip(cp1, chipTime(cp1) + enc);
+        }
+    }
+    Request net_req(Request::Type::NetworkSend);
+    net_req.addAddr(src_addr, wire);
+    net_req.addAddr(dst_addr, wire);
+    tot_clks += sendNetReq(net_req);
+    if (dec > 0) {
+        if (_estimating) {
+            _est_floor[cp2] += dec;
+            _est_chip[cp2] = std::max(_est_chip[cp2], _est_floor[cp2]);
+        } else {
+            tot_clks += advanceChip(cp2, chipTime(cp2) + dec);
+        }
+    }
+    return tot_clks;
+}
+
+void
+System::reportCompression()
+{
+    if (_compress == Compression::None)
+        return;
+    fprintf(rstFile, "Compression: %s, %lu of %lu transfers compressed\n",
+            compressionName(_compress), _compress_used, _compress_xfers);
+    fprintf(rstFile, "Transfer bits: %lu raw, %lu on the network (ratio %.2lf)\n",
+            _compress_raw, _compress_wire, 
+            _compress_wire ? (double)_compress_raw / _compress_wire : 1.0);
+    fprintf(rstFile, "Codec cycles: %lu encoding, %lu decoding\n", 
+            _compress_enc, _compress_dec);
+}
+
+/*
+ * Live statistics. setLiveStats() maps a POSIX shared-memory segment which
+ * the simulation republishes every few thousand requests, so that another
+ * process (watchStats, see pimstat.cpp) can follow a long run while it is
+ * going. The simulation is the only writer. Each publication is bracketed
+ * by a sequence number that is odd while the counters are being written,
+ * and the reader retries until both ends show the same even number.
+ */
+namespace {
+
+const uint64_t live_magic = 0x7374617473696d70ULL;
+
+const struct {
+    Request::Type type;
+    const char* name;
+} live_types[] = {
+    {Request::Type::Read, "Read"}, {Request::Type::Write, "Write"},
+    {Request::Type::RowMv, "RowMv"}, {Request::Type::ColMv, "ColMv"},
+    {Request::Type::RowAdd, "RowAdd"}, {Request::Type::ColAdd, "ColAdd"},
+    {Request::Type::RowSub, "RowSub"}, {Request::Type::ColSub, "ColSub"},
+    {Request::Type::RowMul, "RowMul"}, {Request::Type::ColMul, "ColMul"},
+    {Request::Type::RowDiv, "RowDiv"}, {Request::Type::ColDiv, "ColDiv"},
+    {Request::Type::RowBitwise, "RowBitwise"}, {Request::Type::ColBitwise, "ColBitwise"},
+    {Request::Type::RowSearch, "RowSearch"}, {Request::Type::ColSearch, "ColSearch"},
+    {Request::Type::RowBufferRead, "RowBufRead"}, {Request::Type::RowBufferWrite, "RowBufWrite"},
+    {Request::Type::ColBufferRead, "ColBufRead"}, {Request::Type::ColBufferWrite, "ColBufWrite"},
+    {Request::Type::NetworkSend, "NetSend"}, {Request::Type::NetworkReceive, "NetReceive"},
+    {Request::Type::SystemRow2Row, "Row2Row"}, {Request::Type::SystemRow2Col, "Row2Col"},
+    {Request::Type::SystemCol2Row, "Col2Row"}, {Request::Type::SystemCol2Col, "Col2Col"},
+};
+
+const int live_ntypes = sizeof(live_types) / sizeof(live_types[0]);
+
+/* Monotonic wall clock, comparable between processes */
+uint64_t
+wallNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+string
+shmName(const string& name)
+{
+    return name[0] == '/' ? name : "/" + name;
+}
+
+/* Seconds as 1h02m03s / 2m03s / 3.4s */
+string
+duration(double sec)
+{
+    char buf[32];
+    uint64_t s = sec;
+    if (s >= 3600)
+        snprintf(buf, sizeof(buf), "%luh%02lum%02lus", s / 3600, s / 60 % 60, s % 60);
+    else if (s >= 60)
+        snprintf(buf, sizeof(buf), "%lum%02lus", s / 60, s % 60);
+    else
+        snprintf(buf, sizeof(buf), "%.1lfs", sec);
+    return buf;
+}
+
+}
+
+/* Segment layout, followed by one clock per chip. The header fields are
+ * written before magic is stored with release order, readers load magic
+ * with acquire order before they look at them. */
+struct System::LiveStats {
+    std::atomic<uint64_t> magic;
+    uint64_t nchips;
+    uint64_t ntypes;
+    uint64_t start_ns;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> update_ns;
+    std::atomic<uint64_t> finished;
+    std::atomic<uint64_t> target;
+    std::atomic<uint64_t> reqs;
+    std::atomic<uint64_t> stall_cycles;
+    std::atomic<uint64_t> net_reqs;
+    std::atomic<uint64_t> net_bytes;
+    std::atomic<uint64_t> type_reqs[live_ntypes];
+
+    std::atomic<uint64_t>* clocks() 
+    { 
+        return reinterpret_cast<std::atomic<uint64_t>*>(this + 1); 
+    }
+};
+
+bool
+System::setLiveStats(const string& name, uint64_t target, uint64_t interval)
+{
+    closeLiveStats();
+    if (name.empty())
+        return true;
+    _live_name = shmName(name);
+    _live_size = sizeof(LiveStats) + (size_t)_nchips * sizeof(uint64_t);
+    /* A segment left behind by an earlier run is unlinked, not truncated:
+     * a reader that still has it mapped keeps valid pages, and the new
+     * segment starts out zeroed with no magic yet */
+    shm_unlink(_live_name.c_str());
+    int fd = shm_open(_live_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    void* seg = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, _live_size) == 0)
+        seg = mmap(NULL, _live_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (seg == MAP_FAILED) {
+        cout << "[Error] cannot create the live stats segment " << _live_name << "!\n";
+        return false;
+    }
+    _live = static_cast<LiveStats*>(seg);
+    _live_interval = std::max<uint64_t>(interval, 1);
+    _live_target = target;
+    _live_type_reqs.assign(live_ntypes, 0);
+    _live_slot.clear();
+    for (int k = 0; k < live_ntypes; k++) {
+        size_t t = (size_t)live_types[k].type;
+        if (t >= _live_slot.size())
+            _live_slot.resize(t + 1, -1);
+        _live_slot[t] = k;
+    }
+    _live->nchips = _nchips;
+    _live->ntypes = live_ntypes;
+    _live->start_ns = wallNs();
+    publishStats();
+    _live->magic.store(live_magic, std::memory_order_release);
+    return true;
+}
+
+void
+System::closeLiveStats()
+{
+    if (!_live)
+        return;
+    publishStats(true);
+    munmap(_live, _live_size);
+    /* Readers that have it mapped keep the final numbers */
+    shm_unlink(_live_name.c_str());
+    _live = NULL;
+}
+
+void
+System::publishStats(bool finished)
+{
+    LiveStats* s = _live;
+    uint64_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s->target.store(_live_target ? _live_target : _live_goal, std::memory_order_relaxed);
+    s->reqs.store(tot_reqs, std::memory_order_relaxed);
+    s->stall_cycles.store(_host_stalls + _ctrl_stalls, std::memory_order_relaxed);
+    s->net_reqs.store(_net_reqs, std::memory_order_relaxed);
+    s->net_bytes.store(_net_bytes, std::memory_order_relaxed);
+    for (int k = 0; k < live_ntypes; k++)
+        s->type_reqs[k].store(_live_type_reqs[k], std::memory_order_relaxed);
+    std::atomic<uint64_t>* clk = s->clocks();
+    for (int i = 0; i < _nchips; i++)
+        clk[i].store(_chip_clock[i], std::memory_order_relaxed);
+    s->update_ns.store(wallNs(), std::memory_order_relaxed);
+    if (finished)
+        s->finished.store(1, std::memory_order_relaxed);
+    s->seq.store(seq + 2, std::memory_order_release);
+    _live_last = tot_reqs;
+}
+
+void
+System::countLiveStats(Request::Type type)
+{
+    if ((size_t)type < _live_slot.size() && _live_slot[(size_t)type] >= 0)
+        _live_type_reqs[_live_slot[(size_t)type]]++;
+}
+
+int
+System::watchStats(const string& name, int period_ms, FILE* out)
+{
+    string shm = shmName(name);
+    int fd = shm_open(shm.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        cout << "[Error] no live stats segment " << shm << "!\n";
+        return 1;
+    }
+    struct stat st;
+    void* seg = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(LiveStats))
+        seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    LiveStats* s = static_cast<LiveStats*>(seg);
+    /* The writer may still be filling in the header of a new segment */
+    uint64_t magic = 0;
+    for (int tries = 0; seg != MAP_FAILED && tries < 100; tries++) {
+        magic = s->magic.load(std::memory_order_acquire);
+        if (magic)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (seg == MAP_FAILED || magic != live_magic || s->ntypes != (uint64_t)live_ntypes
+            || (size_t)st.st_size < sizeof(LiveStats) + s->nchips * sizeof(uint64_t)) {
+        cout << "[Error] " << shm << " is not a live stats segment!\n";
+        if (seg != MAP_FAILED)
+            munmap(seg, st.st_size);
+        return 1;
+    }
+
+    uint64_t last_reqs = 0, last_ns = s->start_ns;
+    while (true) {
+        /* Consistent snapshot of one publication */
+        uint64_t reqs, stalls, net_reqs, net_bytes, update_ns, target, finished;
+        uint64_t types[live_ntypes];
+        TimeT lo, hi;
+        vector<TimeT> clocks(s->nchips);
+        while (true) {
+            uint64_t seq = s->seq.load(std::memory_order_acquire);
+            reqs = s->reqs.load(std::memory_order_relaxed);
+            stalls = s->stall_cycles.load(std::memory_order_relaxed);
+            net_reqs = s->net_reqs.load(std::memory_order_relaxed);
+            net_bytes = s->net_bytes.load(std::memory_order_relaxed);
+            update_ns = s->update_ns.load(std::memory_order_relaxed);
+            target = s->target.load(std::memory_order_relaxed);
+            finished = s->finished.load(std::memory_order_relaxed);
+            for (int k = 0; k < live_ntypes; k++)
+                types[k] = s->type_reqs[k].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < clocks.size(); i++)
+                clocks[i] = s->clocks()[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!(seq & 1) && seq == s->seq.load(std::memory_order_relaxed))
+                break;
+            std::this_thread::yield();
+        }
+        clockRange(clocks.data(), clocks.size(), lo, hi);
+
+        double elapsed = (update_ns - s->start_ns) * 1e-9;
+        double rate = update_ns > last_ns ? (reqs - last_reqs) * 1e9 / (update_ns - last_ns) : 0;
+        fprintf(out, "[%s] %lu reqs, %.0lf req/s, sim %lu..%lu cycles, %lu stall cycles, "
+                "net %lu reqs %.2lf MB", duration(elapsed).c_str(), reqs, rate, lo, hi, 
+                stalls, net_reqs, net_bytes / 1e6);
+        if (target > reqs && reqs > 0)
+            fprintf(out, ", ETA %s", duration((target - reqs) * elapsed / reqs).c_str());
+        /* The three most frequent request types */
+        int top[3] = {-1, -1, -1};
+        for (int k = 0; k < live_ntypes; k++) {
+            if (!types[k])
+                continue;
+            for (int j = 0; j < 3; j++) {
+                if (top[j] < 0 || types[k] > types[top[j]]) {
+                    for (int m = 2; m > j; m--)
+                        top[m] = top[m - 1];
+                    top[j] = k;
+                    break;
+                }
+            }
+        }
+        for (int j = 0; j < 3 && top[j] >= 0 && reqs > 0; j++)
+            fprintf(out, "%s %s %.0lf%%", j ? "," : ";", live_types[top[j]].name, 
+                    100.0 * types[top[j]] / reqs);
+        /* Nothing published for a while: stuck inside one request */
+        double silent = (wallNs() - update_ns) * 1e-9;
+        if (!finished && silent > std::max(5.0, 5e-3 * period_ms))
+            fprintf(out, "; no progress for %s", duration(silent).c_str());
+        else if (!finished && update_ns > last_ns && reqs == last_reqs)
+            fprintf(out, "; stalled on admission");
+        fprintf(out, "\n");
+        fflush(out);
+        if (finished)
+            break;
+        last_reqs = reqs;
+        last_ns = update_ns;
+        std::this_thread::sleep_for(std::chrono::milliseconds(period_ms));
+    }
+    munmap(seg, st.st_size);
+    return 0;
+}
+
+void System::matrix_mul_area_optimized(int A_row, int A_col, int B_row, int B_col, Precision p) 
+{
+    int bits = precisionBits(p); // operand width, each element takes bits columns
+    Precision saved_precision = _precision;
+    _precision = p;
+
+    AddrT storage_start_address =  (AddrT)_ncols *_nrows * _nblocks * _ntiles / 4 * 3; // use the last 3/4 for storage units
+    AddrT pim_start_address = 0;
+
+    int mul1_p = 0;
+    int height = 40;
+    int a_p    = mul1_p;
+    int b_p    = 2;
+
+    AddrT data_a_p = 0;
+    AddrT data_b_p = (AddrT)200*_ncols*_nrows;
+    AddrT pim_p = 0;
+    AddrT sum_p = (AddrT)4000* (AddrT)_ncols* (AddrT)_nrows; //TODO
+
+
+    pim_p  = pim_start_address;
+    data_a_p = storage_start_address;
+    data_b_p = storage_start_address + (AddrT) 2*256*1024*1024;
+
+
+    //Double buffer for B: block 0 and block 1 of the PIM region
+    AddrT pim_buf[2] = {pim_p, pim_p + (AddrT)_ncols*_nrows};
+    auto load_b = [&](int b_col, AddrT pim_dst) {
+        Request load(Request::Type::SystemCol2Col);
+        for (int ii = 0; ii < 2; ii++){// no of blocks used
+            load.addAddr(data_b_p + (AddrT)(b_col*2  + ii), 20*bits);
+            load.addAddr(pim_dst  + (AddrT) (b_p + ii*2) ,20*bits);
+        }
+        return load;
+    };
+
+   	std::vector<Request> requests;
+   	Request *request;
+   	//Loop to traverse A
+   	for (int a_ii = 0; a_ii < A_row;a_ii++){
+//------------------------transmit one A row to the block 0------------------------------------------//
+    	request = new Request(Request::Type::SystemCol2Col);
+    	for (int ii = 0; ii < 1; ii++){// no of blocks used
+    		request->addAddr(data_a_p + (AddrT)(a_ii*2  + ii), 20*bits);
+    		request->addAddr(pim_p  + (AddrT) (a_p + ii*2) ,20*bits);
+    	}
+    	requests.push_back(*request);
+                 //-----------Shift A ------------//
+    	request = new Request(Request::Type::ColBitwise);
+    	for (int no_bit_byte= 0; no_bit_byte < bits;no_bit_byte++){//i: index of current A row
+    		request->addAddr(pim_p  + (AddrT)(bits + no_bit_byte) ,20);//In real case, we need to define the location of each A col
+    	}
+    	requests.push_back(*request);
+                 //-----------ColMv A to get complete one colum------------//
+    	request = new Request(Request::Type::ColMv);
+    	request->addAddr(pim_p  + (AddrT) (a_p + 2) ,20*bits);
+    	request->addAddr(pim_p  + (AddrT) (a_p) ,20*bits);
+    	//requests.push_back(*request);
+
+    		for (unsigned int i = 0; i < requests.size(); i++){
+    			//sendRequest(requests[i]);
+    		}
+    		std::vector<Request>().swap(requests);
+
+    	//Loop to traverse B
+    	if (_prefetch && B_col > 0) {
+    		Request load = load_b(0, pim_buf[0]);
+    		prefetch(load);
+    	}
+    	for (int b_ii = 0; b_ii <B_col;b_ii++){
+    		// With prefetch, B columns alternate between two PIM blocks
+    		AddrT pim_b = _prefetch ? pim_buf[b_ii & 1] : pim_p;
+//------------------------transmit one B col to the block 0------------------------------------------//
+    		if (!_prefetch) {
+    			requests.push_back(load_b(b_ii, pim_p));
+    			for (unsigned int i = 0; i < requests.size(); i++){
+    				sendRequest(requests[i]);
+    			}
+    			std::vector<Request>().swap(requests);
+    		}
+                 //-----------Shift B ------------//
+    		request = new Request(Request::Type::ColBitwise);
+    		for (int no_bit_byte= 0; no_bit_byte < bits;no_bit_byte++){//i: index of current A row
+    			request->addAddr(pim_b  + (AddrT)(3*bits + no_bit_byte) ,20);//In real case, we need to define the location of each A col
+    		}
+    		requests.push_back(*request);
+    		for (unsigned int i = 0; i < requests.size(); i++){
+    			sendRequest(requests[i]);
+    		}
+    		std::vector<Request>().swap(requests);
+                 //-----------ColMv B to get complete one colum------------//
+    		request = new Request(Request::Type::ColMv);
+    		request->addAddr(pim_b  + (AddrT) (b_p + 2) ,20*bits);
+    		request->addAddr(pim_b  + (AddrT) (b_p) ,20*bits);
+    		requests.push_back(*request);
+    		for (unsigned int i = 0; i < requests.size(); i++){
+    			sendRequest(requests[i]);
+    		}
+    		std::vector<Request>().swap(requests);
+//------------------------Calculation------------------------------------------//
+    		//start loading the next B col into the other buffer while computing
+    		if (_prefetch && b_ii + 1 < B_col) {
+    			Request load = load_b(b_ii + 1, pim_buf[(b_ii + 1) & 1]);
+    			prefetch(load);
+    		}
+    		//loop to do multiplication
+    		request = new Request(Request::Type::RowMul);
+    		for (int m_i = 0; m_i <height;m_i++){
+    			request->addAddr(pim_b  + (AddrT) (m_i*_ncols) ,2*bits); //The results is stored at sum_p
+    		}
+    		requests.push_back(*request);
+    		//loop to do addition
+    		for (int add_i = 1; add_i <height;add_i++){
+    			request = new Request(Request::Type::ColAdd);
+    			request->addAddr(pim_b,2*bits);//The results will be stored at the end of this col
+    			requests.push_back(*request);
+    		}
+    		//with prefetch the whole calculation is issued behind the transfer
+    		//and waited for once
+    		for (unsigned int i = 0; i < requests.size(); i++){
+    			if (_prefetch)
+    				dispatchRequest(requests[i]);
+    			else
+    				sendRequest(requests[i]);
+    		}
+    		if (_prefetch)
+    			completeRequests();
+    		std::vector<Request>().swap(requests);
+
+    		//send sum back to storage unit
+    		request = new Request(Request::Type::SystemRow2Row);
+    		request->addAddr(pim_b  + (AddrT) (2*height -1 ) ,bits);//The results will be stored at the end of this col
+    		request->addAddr(sum_p ,bits);//The results will be stored at the end of this col
+    		requests.push_back(*request);
+    		//update sum_p to the next block
+    		sum_p = sum_p + (AddrT)_ncols*_nrows;
+    		//issure request
+    		for (unsigned int i = 0; i < requests.size(); i++){
+    			sendRequest(requests[i]);
+    		}
+    		std::vector<Request>().swap(requests);
+
+    	}//loop to traverse B
+    }//loop to traverse A
+
+    _precision = saved_precision;
+}
+
+void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_col, Precision p) 
+{
+    int bits = precisionBits(p); // operand width, each element takes bits columns
+    Precision saved_precision = _precision;
+    _precision = p;
+
+    AddrT storage_start_address =  (AddrT)_ncols *_nrows * _nblocks * _ntiles / 4 * 3; // use the last 3/4 for storage units
+    AddrT pim_start_address = 0;
+
+    //The data will be arranged in block in this way
+    //[0]-----[1]-----[2:11]-----[12:21]-----[22:31]
+    //MUL1---MUL2-------A-----------B----------PS---
+
+    int mul1_p = 0;
+    int mul2_p = 1;
+    int a_width = 1;     // Number of row in block which are occupied by A
+    int b_width = 1;     // Number of row in block which are occupied by B
+    int height = 40;     // Number of row in block which are occupied by B
+    int a_p    = 0;
+    int b_p    = mul2_p;
+    int ps_p   = b_p + 1;
+    int block_row = 32; // Number of data can be stored in one row of block
+    int block_col = 1024; // Number of data can be stored in one col of block
+    int no_block = A_col/a_width * B_col/b_width * (A_col/height);
+    int no_block_same_a = B_col/b_width* (A_col/height);
+    int no_block_same_b = A_row/a_width;
+    int a_sb_y = ceil((float)A_row/(float)a_width );
+    int b_sb_x = ceil((float)B_col/(float) b_width);
+    int last_sum_p = height;
+
+
+    AddrT data_a_p = 0;
+    AddrT data_b_p = 0;
+    AddrT pim_a_p = 0;
+    AddrT pim_b_p = 0;
+    AddrT sum_p = 4000*_ncols*_nrows; //TODO
+
+
+    data_a_p = storage_start_address;
     pim_a_p  = pim_start_address;
     data_b_p = storage_start_address + (AddrT) 2*256*1024*1024;
     pim_b_p  = pim_start_address;
@@ -1059,8 +4782,8 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     for (int n_a_row = 0; n_a_row < A_row * (A_row/height); n_a_row++){//i: index of current A row
     	for (int n_blk = 0; n_blk < no_block_same_a; n_blk++){// no of blocks used
     		for (int ii = 0; ii < A_row/20; ii++){// no of blocks used
-    			request->addAddr(data_a_p + (AddrT)(n_a_row *2 + ii), 20*32);
-    			request->addAddr(pim_a_p  + (AddrT) ((AddrT) n_a_row *(AddrT)  no_block_same_a*(AddrT) _ncols*(AddrT) _nrows + (AddrT) n_blk *(AddrT) _ncols*(AddrT) _nrows + (AddrT) a_p + (AddrT) ii*2) ,20*32);
+    			request->addAddr(data_a_p + (AddrT)(n_a_row *2 + ii), 20*bits);
+    			request->addAddr(pim_a_p  + (AddrT) ((AddrT) n_a_row *(AddrT)  no_block_same_a*(AddrT) _ncols*(AddrT) _nrows + (AddrT) n_blk *(AddrT) _ncols*(AddrT) _nrows + (AddrT) a_p + (AddrT) ii*2) ,20*bits);
     		}
     	}
     }
@@ -1070,8 +4793,8 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     for (int n_b_col = 0; n_b_col < B_col * B_col/height; n_b_col++){//i: index of current A row
     	for (int n_blk = 0; n_blk < no_block_same_b; n_blk++){// no of blocks used
     		for (int ii = 0; ii < B_col/20; ii++){// no of blocks used
-    			request->addAddr(data_b_p + (AddrT)(n_b_col *2 + ii), 20*32);
-    			request->addAddr(pim_b_p  + (AddrT) ((AddrT) n_blk *(AddrT)  no_block_same_a * (AddrT) _ncols*(AddrT) _nrows + ((AddrT) n_b_col/(AddrT) b_width)) *(AddrT) _ncols*(AddrT) _nrows + (AddrT) b_p + (AddrT) n_b_col%(AddrT) b_width + (AddrT) ii*2 ,20*32);
+    			request->addAddr(data_b_p + (AddrT)(n_b_col *2 + ii), 20*bits);
+    			request->addAddr(pim_b_p  + (AddrT) ((AddrT) n_blk *(AddrT)  no_block_same_a * (AddrT) _ncols*(AddrT) _nrows + ((AddrT) n_b_col/(AddrT) b_width)) *(AddrT) _ncols*(AddrT) _nrows + (AddrT) b_p + (AddrT) n_b_col%(AddrT) b_width + (AddrT) ii*2 ,20*bits);
     		}
     	}
     }
@@ -1085,9 +4808,9 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
 //shift
     request = new Request(Request::Type::ColBitwise);
     for (int n_b_blk= 0; n_b_blk < no_block;n_b_blk++){//i: index of current A row
-    	for (int no_bit_byte= 0; no_bit_byte < 32;no_bit_byte++){//i: index of current A row
-    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + (a_p + 2 + no_bit_byte)*32) ,20);
-    		request->addAddr(pim_b_p  + (AddrT) (n_b_blk * _ncols*_nrows + (b_p + 2 + no_bit_byte)*32) ,20);
+    	for (int no_bit_byte= 0; no_bit_byte < bits;no_bit_byte++){//i: index of current A row
+    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + (a_p + 2 + no_bit_byte)*bits) ,20);
+    		request->addAddr(pim_b_p  + (AddrT) (n_b_blk * _ncols*_nrows + (b_p + 2 + no_bit_byte)*bits) ,20);
     	}
     }
     requests.push_back(*request);
@@ -1116,7 +4839,7 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     request = new Request(Request::Type::RowMul);
     for (int n_b_blk= 0; n_b_blk < no_block;n_b_blk++){//i: index of current A row
     	for (int no_h = 0; no_h < height;no_h++){//i: index of current A row
-    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + no_h*_ncols) ,2*32); //The results is stored at sum_p
+    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + no_h*_ncols) ,2*bits); //The results is stored at sum_p
     	}
     }
     requests.push_back(*request);
@@ -1131,7 +4854,7 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     for (int no_h = 1; no_h <height;no_h++){
     	request = new Request(Request::Type::ColAdd);
     	for (int n_b_blk= 0; n_b_blk < no_block;n_b_blk++){//i: index of current A row
-    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + no_h*2*_ncols) ,2*32);//The results will be stored at the end of this col
+    		request->addAddr(pim_a_p  + (AddrT) (n_b_blk * _ncols*_nrows + no_h*2*_ncols) ,2*bits);//The results will be stored at the end of this col
     	}
     	requests.push_back(*request);
     	for (unsigned int i = 0; i < requests.size(); i++){
@@ -1146,8 +4869,8 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     request = new Request(Request::Type::SystemRow2Row);
     for (int n_b_blk= 0; n_b_blk < no_block;n_b_blk++){
     //for (int n_b_blk= 0; n_b_blk < 64;n_b_blk++){
-    	request->addAddr(pim_a_p  + (AddrT) ((AddrT)n_b_blk *(AddrT) _ncols*(AddrT)_nrows + 2*(AddrT)height -1 ) ,32);//The results will be stored at the end of this col
-    	request->addAddr(data_a_p  +  ((AddrT)n_b_blk * (AddrT)_ncols*(AddrT)_nrows ) ,32);//The results will be stored at the end of this col
+    	request->addAddr(pim_a_p  + (AddrT) ((AddrT)n_b_blk *(AddrT) _ncols*(AddrT)_nrows + 2*(AddrT)height -1 ) ,bits);//The results will be stored at the end of this col
+    	request->addAddr(data_a_p  +  ((AddrT)n_b_blk * (AddrT)_ncols*(AddrT)_nrows ) ,bits);//The results will be stored at the end of this col
     }
     requests.push_back(*request);
     for (unsigned int i = 0; i < requests.size(); i++){
@@ -1155,14 +4878,25 @@ void System::matrix_mul_time_optimized(int A_row, int A_col, int B_row, int B_co
     }
     std::vector<Request>().swap(requests);
 
-
-
-
-
-
+    _precision = saved_precision;
 }
 
-void System::matrix_mul_balanced(int A_row, int A_col, int B_row, int B_col) 
+void System::matrix_mul_balanced(int A_row, int A_col, int B_row, int B_col, Precision p) 
 {
-/*Write your code here*/
+    //A stays resident in the PIM blocks, one element per block column, with
+    //its rows balanced over the chips; every column of B is a vector
+    //streamed through the same gather/multiply/reduce pipeline as spmv_csr.
+    //A (row-major), the columns of B and those of the result are kept in
+    //the storage units in spmv_csr's layout, A being there already
+    if (A_col != B_row) {
+        cout << "[Error] cannot multiply a " << A_row << "x" << A_col << " matrix by a "
+             << B_row << "x" << B_col << " matrix!\n";
+        return;
+    }
+    std::vector<int> row_ptr(A_row + 1), col_idx((size_t)A_row * A_col);
+    for (int i = 0; i <= A_row; i++)
+        row_ptr[i] = i * A_col;
+    for (size_t i = 0; i < col_idx.size(); i++)
+        col_idx[i] = i % A_col;
+    spmvStorage(A_row, A_col, row_ptr, col_idx, NULL, B_col, p);
 }